@@ -6,6 +6,7 @@
 #include <filter.hh>
 #include <signal.h>
 
+#include <map>
 #include <unordered_map>
 #include <string>
 #include <vector>
@@ -14,6 +15,8 @@ using namespace kcov;
 
 class Collector : public ICollector,
 		public IFileParser::ILineListener,
+		public IFileParser::IFunctionListener,
+		public IFileParser::IBasicBlockListener,
 		public IEngine::IEventListener
 {
 public:
@@ -22,6 +25,21 @@ public:
 					m_signalExit(false), m_filter(filter)
 	{
 		m_fileParser.registerLineListener(*this);
+
+		// Only arm the lines of a function when it's entered
+		m_lazyBreakpoints = IConfiguration::getInstance().keyAsInt("lazy-breakpoints");
+		if (m_lazyBreakpoints)
+			m_fileParser.registerFunctionListener(*this);
+
+		// Take one trap per basic block instead of one per line
+		if (IConfiguration::getInstance().keyAsInt("basic-block-breakpoints"))
+		{
+#if KCOV_HAS_LIBBFD == 0
+			warning("kcov has been built without libbfd-dev (or binutils-dev), so\n"
+					"--basic-block-breakpoints will not do anything.\n");
+#endif
+			m_fileParser.registerBasicBlockListener(*this);
+		}
 	}
 
 	void registerListener(ICollector::IListener &listener)
@@ -178,11 +196,62 @@ private:
 			return;
 		}
 
+		registerLineBreakpoint(addr);
+	}
+
+	// From IFileParser
+	void onLines(const std::string &file, const LineAddrList_t &lines)
+	{
+		if (!m_filter.runFilters(file))
+			return;
+
+		for (LineAddrList_t::const_iterator it = lines.begin(); it != lines.end(); ++it)
+			registerLineBreakpoint(it->second);
+	}
+
+	void registerLineBreakpoint(uint64_t addr)
+	{
+		uint64_t entry;
+
+		if (m_lazyBreakpoints && lookupFunction(addr, entry) && entry != addr)
+		{
+			m_engine.registerLazyBreakpoint(entry, addr);
+			return;
+		}
+
 		m_engine.registerBreakpoint(addr);
 	}
 
+	// From IFileParser
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		m_functions[start] = end;
+	}
+
+	// From IFileParser
+	void onBasicBlock(uint64_t first, uint64_t last)
+	{
+		m_engine.registerBasicBlock(first, last);
+	}
+
+	bool lookupFunction(uint64_t addr, uint64_t &entry) const
+	{
+		FunctionMap_t::const_iterator it = m_functions.upper_bound(addr);
+
+		if (it == m_functions.begin())
+			return false;
+		--it;
+
+		if (addr >= it->second)
+			return false;
+		entry = it->first;
+
+		return true;
+	}
+
 	typedef std::vector<ICollector::IListener *> ListenerList_t;
 	typedef std::vector<ICollector::IEventTickListener *> EventTickListenerList_t;
+	typedef std::map<uint64_t, uint64_t> FunctionMap_t; // start -> end
 
 	IFileParser &m_fileParser;
 	IEngine &m_engine;
@@ -190,6 +259,8 @@ private:
 	EventTickListenerList_t m_eventTickListeners;
 	int m_exitCode;
 	bool m_signalExit;
+	bool m_lazyBreakpoints;
+	FunctionMap_t m_functions;
 
 	IFilter &m_filter;
 };
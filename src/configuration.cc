@@ -125,6 +125,13 @@ public:
 		{ "path-strip-level", required_argument, 0, 'S' },
 		{ "skip-solibs", no_argument, 0, 'L' },
 		{ "exit-first-process", no_argument, 0, 'F' },
+		{ "multi-core", no_argument, 0, 'K' },
+		{ "tracer-threads", no_argument, 0, 'W' },
+		{ "lazy-breakpoints", no_argument, 0, 'Y' },
+		{ "basic-block-breakpoints", no_argument, 0, 'Q' },
+		{ "pause-budget", required_argument, 0, 'N' },
+		{ "auto-detach", no_argument, 0, 'A' },
+		{ "line-cache", required_argument, 0, 'H' },
 		{ "clang", no_argument, 0, 'c' },
 		{ "configure", required_argument, 0, 'M' },
 		{ "clean", no_argument, 0, 'E' },
@@ -213,6 +220,30 @@ public:
 			case 'L':
 				setKey("parse-solibs", 0);
 				break;
+			case 'K':
+				setKey("multi-core", 1);
+				break;
+			case 'W':
+				setKey("tracer-threads", 1);
+				break;
+			case 'Y':
+				setKey("lazy-breakpoints", 1);
+				break;
+			case 'Q':
+				setKey("basic-block-breakpoints", 1);
+				break;
+			case 'N':
+				if (!isInteger(std::string(optarg)))
+					return usage();
+
+				setKey("pause-budget", stoul(std::string(optarg)));
+				break;
+			case 'A':
+				setKey("auto-detach", 1);
+				break;
+			case 'H':
+				setKey("line-cache", std::string(optarg));
+				break;
 			case 'F':
 				setKey("daemonize-on-first-process-exit", 1);
 				break;
@@ -583,6 +614,13 @@ public:
 		setKey("high-limit", 75);
 		setKey("output-interval", 5000);
 		setKey("daemonize-on-first-process-exit", 0);
+		setKey("multi-core", 0);
+		setKey("tracer-threads", 0);
+		setKey("lazy-breakpoints", 0);
+		setKey("basic-block-breakpoints", 0);
+		setKey("pause-budget", 0);
+		setKey("auto-detach", 0);
+		setKey("line-cache", "");
 		setKey("dump-summary", 0);
 		setKey("coveralls-id", "");
 		setKey("strip-path", "");
@@ -717,6 +755,20 @@ public:
 						" --skip-solibs           don't parse shared libraries (default: parse solibs)\n"
 						" --exit-first-process    exit when the first process exits, i.e., honor the\n"
 						"                         behavior of daemons (default: wait until last)\n"
+						" --multi-core            don't pin the traced program to a single CPU, stop\n"
+						"                         its threads while setting breakpoints instead\n"
+						" --tracer-threads        trace each process from a thread of its own, for\n"
+						"                         programs which fork a lot (use with --multi-core)\n"
+						" --lazy-breakpoints      only set the breakpoints in a function when it's\n"
+						"                         first called, for programs with a lot of dead code\n"
+						" --basic-block-breakpoints  report the rest of a basic block when one of its\n"
+						"                         breakpoints is hit, to take fewer traps (x86 only)\n"
+						" --pause-budget=ms       stop the program at most this long for setting up\n"
+						"                         breakpoints, and set the rest later (default: 0, off)\n"
+						" --auto-detach           stop tracing processes where all breakpoints have\n"
+						"                         been hit\n"
+						" --line-cache=dir        keep the source lines of binaries with a build-id in\n"
+						"                         dir, to skip reading the DWARF data on later runs\n"
 						" --output-interval=ms    Interval to produce output in milliseconds (0 to\n"
 						"                         only output when kcov terminates, default %d)\n"
 						"\n"
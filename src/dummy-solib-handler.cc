@@ -8,9 +8,37 @@ public:
 	virtual void startup()
 	{
 	}
+
+	virtual void finish()
+	{
+	}
 };
 
-void kcov::blockUntilSolibDataRead()
+unsigned int kcov::waitForSolibData(pid_t pid, unsigned int count)
+{
+	return 0;
+}
+
+void kcov::forgetSolibData(pid_t pid)
+{
+}
+
+bool kcov::solibDataPending()
+{
+	return false;
+}
+
+bool kcov::isSolibTrap(pid_t pid, uint64_t addr)
+{
+	return false;
+}
+
+std::string kcov::execImageId(const struct phdr_data_entry *image)
+{
+	return "";
+}
+
+void kcov::parseExecImage(struct phdr_data_entry *image)
 {
 }
 
@@ -1,6 +1,8 @@
 #include <sys/types.h>
 
+#include <breakpoint-table.hh>
 #include <engine.hh>
+#include <mpsc-queue.hh>
 #include <utils.hh>
 #include <configuration.hh>
 #include <output-handler.hh>
@@ -11,13 +13,18 @@
 #include "ptrace_sys.hh"
 
 #include <sys/wait.h>
+#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <memory>
 #include <unordered_map>
 #include <list>
 #include <mutex>
+#include <unordered_set>
 #include <vector>
 
 using namespace kcov;
@@ -25,6 +32,9 @@ using namespace kcov;
 #define str(s) #s
 #define xstr(s) str(s)
 
+// With --pause-budget, the text patched in one go, so that the time is checked often enough
+static const unsigned long maxSliceRange = 64 * 1024;
+
 static unsigned long getAligned(unsigned long addr)
 {
 	return (addr / sizeof(unsigned long)) * sizeof(unsigned long);
@@ -92,12 +102,26 @@ class Ptrace : public IEngine
 {
 public:
 	Ptrace() : m_firstBreakpoint(true), m_activeChild(0), m_child(0), m_firstChild(0),
-		m_parentCpu(0), m_listener(NULL), m_signal(0)
+		m_parentCpu(0), m_multiCore(false), m_basicBlockBreakpoints(false), m_autoDetach(false),
+		m_attached(false), m_listener(NULL), m_signal(0), m_breakpointStops(0),
+		m_lastSignalAddress(0), m_pauseBudget(0), m_longestPause(0), m_coordinator(NULL), m_tracerThreads(false), m_tracerRoot(0),
+		m_syncSemaphore(0), m_syncWithCollector(false), m_eventSemaphore(0), m_syncTracer(NULL),
+		m_liveTracers(0), m_maxTracers(1), m_startOk(false), m_firstChildExited(false), m_recordingExec(false)
 	{
+		m_pageSize = sysconf(_SC_PAGESIZE);
+		m_instructionMap = std::make_shared<instructionMap_t>();
+		m_lazyBreakpoints = std::make_shared<LazyBreakpointMap_t>();
 	}
 
 	~Ptrace()
 	{
+		kcov_debug(ENGINE_MSG, "PT %lu breakpoint stops, %lu register accesses, longest arming pause %llu us\n",
+				m_breakpointStops, ptrace_sys::getRegisterAccesses(), (unsigned long long) m_longestPause);
+
+		// Tracer threads are only deleted when their processes are gone
+		if (m_coordinator)
+			return;
+
 		kill(SIGTERM);
 		ptrace_sys::detach(m_activeChild);
 	}
@@ -106,24 +130,38 @@ public:
 	{
 		m_listener = &listener;
 
+		// Without pinning, other threads are stopped while breakpoints are armed instead
+		m_multiCore = IConfiguration::getInstance().keyAsInt("multi-core");
+
+		m_basicBlockBreakpoints = IConfiguration::getInstance().keyAsInt("basic-block-breakpoints");
+
+		m_autoDetach = IConfiguration::getInstance().keyAsInt("auto-detach");
+		m_attached = IConfiguration::getInstance().keyAsInt("attach-pid") != 0;
+
+		// In milliseconds, 0 to arm everything in one stop
+		m_pauseBudget = IConfiguration::getInstance().keyAsInt("pause-budget") * 1000ULL;
+
+		m_tracerThreads = IConfiguration::getInstance().keyAsInt("tracer-threads");
+		if (m_tracerThreads && !ptrace_sys::has_tracer_threads())
+		{
+			warning("--tracer-threads is not supported on this platform\n");
+			m_tracerThreads = false;
+		}
+
 		m_parentCpu = ptrace_sys::get_current_cpu();
-		ptrace_sys::tie_process_to_cpu(getpid(), m_parentCpu);
+		if (!m_multiCore)
+			ptrace_sys::tie_process_to_cpu(getpid(), m_parentCpu);
 
-		m_instructionMap.clear();
+		m_instructionMap = std::make_shared<instructionMap_t>();
 
 		/* Basic check first */
 		if (access(executable.c_str(), X_OK) != 0)
 			return false;
 
-		unsigned int pid = IConfiguration::getInstance().keyAsInt("attach-pid");
-		bool res = false;
-
-		if (pid != 0)
-			res = attachPid(pid);
-		else
-			res = forkChild(executable.c_str());
+		if (m_tracerThreads)
+			return startTracerThreads(executable);
 
-		return res;
+		return startChild(executable);
 	}
 
 	int registerBreakpoint(unsigned long addr)
@@ -131,15 +169,17 @@ public:
 		if (addr == 0)
 			return -1;
 
-		unsigned long data;
+		if (m_recordingExec)
+			m_execBreakpoints.push_back(addr);
+
+		if (m_tracerThreads)
+			return registerTracerBreakpoint(0, addr);
 
 		// There already?
-		if (m_instructionMap.find(addr) != m_instructionMap.end())
+		if (m_instructionMap->contains(addr))
 			return 0;
 
-		data = ptrace_sys::peekWord(m_activeChild, getAligned(addr));
-
-		m_instructionMap[addr] = data;
+		// Added to the map with the original instruction when the breakpoint is armed
 		m_pendingBreakpoints.push_back(addr);
 
 		kcov_debug(BP_MSG, "BP registered at 0x%lx\n", addr);
@@ -147,21 +187,60 @@ public:
 		return 0;
 	}
 
+	int registerLazyBreakpoint(unsigned long entry, unsigned long addr)
+	{
+		if (addr == 0 || entry == 0)
+			return -1;
+
+		if (m_recordingExec)
+			m_execBreakpoints.push_back(addr);
+
+		if (m_tracerThreads)
+			return registerTracerBreakpoint(entry, addr);
+
+		// There already?
+		if (m_instructionMap->contains(addr))
+			return 0;
+
+		// Kept for the address spaces which haven't entered the function yet
+		writableLazyBreakpoints()[entry].push_back(addr);
+
+		// Function already entered?
+		if (functionEntered(entry))
+			return registerBreakpoint(addr);
+
+		kcov_debug(BP_MSG, "BP 0x%lx deferred until 0x%lx\n", addr, entry);
+
+		return registerBreakpoint(entry);
+	}
+
+	void registerBasicBlock(unsigned long first, unsigned long last)
+	{
+		std::lock_guard<std::mutex> lock(m_basicBlocksMutex);
+
+		m_basicBlocks[first] = last;
+	}
+
 	bool clearBreakpoint(unsigned long addr)
 	{
-		if (m_instructionMap.find(addr) == m_instructionMap.end())
+		const unsigned long *orig = m_instructionMap->lookup(addr);
+
+		if (!orig)
 		{
 			kcov_debug(BP_MSG, "Can't find breakpoint at 0x%lx\n", addr);
 
-			// Stupid workaround for avoiding the solib thread race
-			msleep(1);
-
 			return false;
 		}
 
-		// Clear the actual breakpoint instruction
-		unsigned long val = m_instructionMap[addr];
-		val = arch_clearBreakpoint(addr, val, ptrace_sys::peekWord(m_activeChild, getAligned(addr)));
+		// Clear the actual breakpoint instruction. This is a single aligned word write,
+		// so it's safe even if other threads run on other CPUs (and threads which have
+		// already hit the breakpoint are handled via m_instructionMap)
+		unsigned long cur = ptrace_sys::peekWord(m_activeChild, getAligned(addr));
+		unsigned long val = arch_clearBreakpoint(addr, *orig, cur);
+
+		// Still armed in this address space, i.e., not hit by another thread
+		if (m_autoDetach && arch_setupBreakpoint(addr, cur) == cur)
+			updateLiveBreakpoints(-1);
 
 		ptrace_sys::pokeWord(m_activeChild, getAligned(addr), val);
 
@@ -170,7 +249,6 @@ public:
 
 	const Event waitEvent()
 	{
-		static uint64_t lastSignalAddress;
 		Event out;
 		int status;
 		pid_t who;
@@ -179,7 +257,24 @@ public:
 		out.type = ev_error;
 		out.data = -1;
 
-		who = ptrace_sys::wait_all(&status);
+		while (1)
+		{
+			who = waitStop(&status);
+
+			if (who == -1)
+				break;
+
+			if (isNewProcess(who))
+			{
+				handOverProcess(who);
+				continue;
+			}
+
+			if (!isGroupStop(who, status))
+				break;
+
+			listenGroupStop(who);
+		}
 
 		if (who == -1)
 		{
@@ -187,7 +282,8 @@ public:
 			return out;
 		}
 
-		m_children[who] = 1;
+		if (m_children.find(who) == m_children.end())
+			m_children[who] = m_multiCore || m_autoDetach ? ptrace_sys::get_tgid(who) : who;
 
 		m_activeChild = who;
 		out.addr = ptrace_sys::getPc(m_activeChild);
@@ -219,6 +315,16 @@ public:
 			{
 				kcov_debug(ENGINE_MSG, "PT fork/clone at 0x%llx for %d\n", (unsigned long long) out.addr, m_activeChild);
 				out.data = 0;
+
+				if (m_autoDetach)
+					inheritLiveBreakpoints(ptrace_sys::getEventChild(m_activeChild));
+			}
+			else if (ptrace_sys::eventIsExec(sig, event))
+			{
+				kcov_debug(ENGINE_MSG, "PT exec at 0x%llx for %d\n", (unsigned long long) out.addr, m_activeChild);
+				out.data = 0;
+
+				handleExec();
 			}
 			else if (sig == SIGTRAP || sig == SIGSTOP || sig == sigill)
 			{
@@ -229,7 +335,9 @@ public:
 				kcov_debug(ENGINE_MSG, "PT BP at 0x%llx:%d for %d\n", (unsigned long long) out.addr, out.data,
 						m_activeChild);
 
-				bool insnFound = m_instructionMap.find(out.addr) != m_instructionMap.end();
+				bool insnFound = m_instructionMap->contains(out.addr);
+
+				m_breakpointStops++;
 
 				// Single-step if we have this BP
 				if (insnFound)
@@ -237,19 +345,17 @@ public:
 				else if (sig != SIGSTOP)
 					ptrace_sys::skipInstruction(m_activeChild);
 
-				// Wait for solib data if this is the first time
-				if (m_firstBreakpoint && insnFound)
-				{
-					blockUntilSolibDataRead();
+				if (insnFound)
 					m_firstBreakpoint = false;
-				}
+				else if (sig != SIGSTOP)
+					waitForSolibTrap(out.addr);
 
 				return out;
 			}
 
 			kcov_debug(ENGINE_MSG, "PT signal %d at 0x%llx for %d\n", WSTOPSIG(status), (unsigned long long) out.addr,
 					m_activeChild);
-			lastSignalAddress = out.addr;
+			m_lastSignalAddress = out.addr;
 		}
 		else if (WIFSIGNALED(status))
 		{
@@ -258,11 +364,19 @@ public:
 
 			out.type = ev_signal;
 			out.data = sig;
-			out.addr = lastSignalAddress;
+			out.addr = m_lastSignalAddress;
 
 			kcov_debug(ENGINE_MSG, "PT terminating signal %d at 0x%llx for %d\n", sig, (unsigned long long) out.addr,
 					m_activeChild);
 			m_children.erase(who);
+			m_pendingSigstops.erase(who);
+			m_liveBreakpoints.erase(who);
+			m_exactLiveBreakpoints.erase(who);
+			m_enteredFunctions.erase(who);
+			forgetSolibTraps(who);
+
+			if (who == m_firstChild && m_coordinator)
+				m_coordinator->m_firstChildExited = true;
 
 			if (!childrenLeft())
 				out.type = ev_signal_exit;
@@ -276,6 +390,14 @@ public:
 					m_activeChild, m_activeChild == m_firstChild ? " (first child)" : "");
 
 			m_children.erase(who);
+			m_pendingSigstops.erase(who);
+			m_liveBreakpoints.erase(who);
+			m_exactLiveBreakpoints.erase(who);
+			m_enteredFunctions.erase(who);
+			forgetSolibTraps(who);
+
+			if (who == m_firstChild && m_coordinator)
+				m_coordinator->m_firstChildExited = true;
 
 			if (who == m_firstChild)
 				out.type = ev_exit_first_process;
@@ -290,6 +412,10 @@ public:
 
 	bool childrenLeft()
 	{
+		// The first child might be traced by another thread
+		if (m_coordinator)
+			return !m_coordinator->m_firstChildExited;
+
 		return m_children.size() > 0 && m_children.find(m_firstChild) != m_children.end();
 	}
 
@@ -300,25 +426,45 @@ public:
 	{
 		int res;
 
+		if (m_tracerThreads)
+			return dispatchTracerEvent();
+
 		setupAllBreakpoints();
+		requestArmingStop();
 
-		kcov_debug(ENGINE_MSG, "PT continuing %d with signal %d\n", m_activeChild, m_signal);
-		res = ptrace_sys::cont(m_activeChild, m_signal);
-		if (res < 0)
+		if (m_autoDetach && canDetach())
+		{
+			detachAddressSpace();
+		}
+		else
 		{
-			kcov_debug(ENGINE_MSG, "PT error for %d: %d\n", m_activeChild, res);
-			m_children.erase(m_activeChild);
+			kcov_debug(ENGINE_MSG, "PT continuing %d with signal %d\n", m_activeChild, m_signal);
+			res = ptrace_sys::cont(m_activeChild, m_signal);
+			if (res < 0)
+			{
+				kcov_debug(ENGINE_MSG, "PT error for %d: %d\n", m_activeChild, res);
+				m_children.erase(m_activeChild);
+			}
 		}
 
 		Event ev = waitEvent();
 		m_signal = ev.type == ev_signal ? ev.data : 0;
 
-		if (m_listener)
-			m_listener->onEvent(ev);
+		reportEvent(ev);
 
 		if (ev.type == ev_breakpoint)
+		{
+			// Arm the lines of a function before the entry breakpoint is removed, so
+			// that other threads can't pass through the function in between
+			if (registerFunctionBreakpoints(ev.addr))
+				setupAllBreakpoints();
+
 			clearBreakpoint(ev.addr);
 
+			if (m_basicBlockBreakpoints)
+				reportBasicBlock(ev.addr);
+		}
+
 		if (ev.type == ev_error)
 			return false;
 
@@ -333,134 +479,1284 @@ public:
 	}
 
 private:
+	typedef BreakpointTable instructionMap_t;
+	typedef std::vector<unsigned long> PendingBreakpointList_t;
+	typedef std::unordered_map<unsigned long, PendingBreakpointList_t> LazyBreakpointMap_t; // entry -> lines
+	typedef std::vector<std::pair<unsigned long, unsigned long>> IncomingBreakpointList_t; // (entry or 0, addr)
+	typedef std::unordered_map<pid_t, pid_t> ChildMap_t; // pid -> thread group
+	typedef std::list<std::pair<pid_t, int>> StopList_t;
+	typedef std::vector<pid_t> PidList_t;
+	typedef std::unordered_set<pid_t> PidSet_t;
+	typedef std::map<unsigned long, unsigned long> BasicBlockMap_t; // first -> last instruction
+	typedef std::unordered_set<unsigned long> AddressSet_t;
+	typedef std::unordered_map<pid_t, long> LiveBreakpointMap_t; // thread group -> armed breakpoints
+	typedef std::unordered_map<pid_t, AddressSet_t> EnteredFunctionMap_t; // thread group -> lazy function entries
+	typedef std::unordered_map<std::string, PendingBreakpointList_t> ExecImageMap_t; // image ID -> breakpoints
+	typedef std::unordered_map<pid_t, unsigned int> SolibTrapMap_t; // thread group -> traps
+
+	void reportEvent(const Event &ev)
+	{
+		if (m_coordinator)
+			forwardEvent(ev);
+		else if (m_listener)
+			m_listener->onEvent(ev);
+	}
 
-	void setupAllBreakpoints()
+	/*
+	 * The rest of a basic block will execute as well, so report the breakpoints
+	 * in it as hit and clear them instead of taking a trap for each of them.
+	 */
+	void reportBasicBlock(unsigned long addr)
 	{
-		for (PendingBreakpointList_t::const_iterator addrIt = m_pendingBreakpoints.begin();
-				addrIt != m_pendingBreakpoints.end(); ++addrIt)
+		unsigned long last;
+
+		// Not a breakpoint, e.g., a thread stopped by a signal
+		if (!m_instructionMap->contains(addr))
+			return;
+
+		m_hitBreakpoints.insert(addr);
+
+		if (!lookupBasicBlock(addr, last))
+			return;
+
+		// Arm pending breakpoints, so that all in the block can be cleared the same way
+		setupAllBreakpoints();
+
+		for (unsigned long cur = addr + 1; cur <= last; cur++)
 		{
-			unsigned long addr = *addrIt;
-			unsigned long cur_data = ptrace_sys::peekWord(m_activeChild, getAligned(addr));
+			if (!m_instructionMap->contains(cur) || !m_hitBreakpoints.insert(cur).second)
+				continue;
 
-			// Set the breakpoint
-			ptrace_sys::pokeWord(m_activeChild, getAligned(addr), arch_setupBreakpoint(addr, cur_data));
+			kcov_debug(BP_MSG, "BP 0x%lx reported via the block of 0x%lx\n", cur, addr);
+
+			clearBreakpoint(cur);
+			reportEvent(Event(ev_breakpoint, -1, cur));
 		}
+	}
+
+	bool lookupBasicBlock(unsigned long addr, unsigned long &last)
+	{
+		// Registered with the collector thread, which tracer threads don't own
+		Ptrace &owner = m_coordinator ? *m_coordinator : *this;
+		std::lock_guard<std::mutex> lock(owner.m_basicBlocksMutex);
+
+		BasicBlockMap_t::const_iterator it = owner.m_basicBlocks.upper_bound(addr);
+
+		if (it == owner.m_basicBlocks.begin())
+			return false;
+		--it;
 
-		m_pendingBreakpoints.clear();
+		if (addr > it->second)
+			return false;
+		last = it->second;
+
+		return true;
 	}
 
-	bool forkChild(const char *executable)
+	/*
+	 * With --auto-detach, the number of armed breakpoints in each address space is
+	 * kept, and the process is detached from when none are left. A forked process
+	 * starts with the count of its parent, and the memory is counted again before
+	 * detaching (or if the process wasn't seen being forked).
+	 */
+	void updateLiveBreakpoints(long delta)
 	{
-		char * const *argv = (char * const *) IConfiguration::getInstance().getArgv();
-		pid_t child, who;
-		int status;
+		ChildMap_t::const_iterator child = m_children.find(m_activeChild);
 
-		/* Executable exists, try to launch it */
-		if ((child = fork()) == 0)
+		if (child == m_children.end())
+			return;
+
+		LiveBreakpointMap_t::iterator it = m_liveBreakpoints.find(child->second);
+
+		if (it != m_liveBreakpoints.end())
+			it->second = std::max(it->second + delta, 0L);
+	}
+
+	void inheritLiveBreakpoints(pid_t child)
+	{
+		ChildMap_t::const_iterator parent = m_children.find(m_activeChild);
+
+		// Threads share the count of the process
+		if (child <= 0 || parent == m_children.end() || ptrace_sys::get_tgid(child) == parent->second)
+			return;
+
+		LiveBreakpointMap_t::const_iterator it = m_liveBreakpoints.find(parent->second);
+
+		if (it != m_liveBreakpoints.end())
+			m_liveBreakpoints.insert(std::make_pair(child, it->second));
+		if (m_exactLiveBreakpoints.find(parent->second) != m_exactLiveBreakpoints.end())
+			m_exactLiveBreakpoints.insert(child);
+	}
+
+	// Count the breakpoints which are armed in the memory of the active child
+	long countArmedBreakpoints()
+	{
+		long out = 0;
+
+		// Breakpoints are never removed, so the list only needs updating if the size changes
+		if (m_sortedBreakpoints.size() != m_instructionMap->size())
 		{
-			int res;
+			m_sortedBreakpoints = m_instructionMap->addresses();
+			std::sort(m_sortedBreakpoints.begin(), m_sortedBreakpoints.end());
+		}
 
-			/* Avoid address randomization */
-			if (!ptrace_sys::disable_aslr())
-				return false;
+		PendingBreakpointList_t::const_iterator first = m_sortedBreakpoints.begin();
+		while (first != m_sortedBreakpoints.end())
+		{
+			PendingBreakpointList_t::const_iterator last = first + 1;
 
-			/* And launch the process */
-			res = ptrace_sys::trace_me();
-			if (res < 0)
+			while (last != m_sortedBreakpoints.end() && getPage(*last) == getPage(*first))
+				++last;
+
+			unsigned long start = getAligned(*first);
+			unsigned long end = getAligned(*(last - 1)) + sizeof(unsigned long);
+
+			m_textBuffer.resize((end - start) / sizeof(unsigned long));
+
+			// Not mapped in this process, e.g., a solib loaded by another one
+			if (ptrace_sys::readMemory(m_activeChild, start, m_textBuffer.data(), end - start))
 			{
-				perror("Can't set me as ptraced");
-				return false;
+				for (PendingBreakpointList_t::const_iterator it = first; it != last; ++it)
+				{
+					unsigned long cur = m_textBuffer[(getAligned(*it) - start) / sizeof(unsigned long)];
+
+					if (arch_setupBreakpoint(*it, cur) == cur)
+						out++;
+				}
 			}
-			ptrace_sys::tie_process_to_cpu(getpid(), m_parentCpu);
-			execv(executable, argv);
 
-			/* Exec failed */
-			return false;
+			first = last;
 		}
 
-		/* Fork error? */
-		if (child < 0)
-		{
-			perror("fork");
+		return out;
+	}
+
+	bool canDetach()
+	{
+		// Breakpoints which are about to be armed
+		if (m_signal != 0 || m_firstBreakpoint || !m_pendingBreakpoints.empty())
 			return false;
-		}
-		m_child = m_activeChild = m_firstChild = child;
-		// Might not be completely necessary (the child should inherit this
-		// from the parent), but better safe than sorry
-		ptrace_sys::tie_process_to_cpu(m_child, m_parentCpu);
 
-		kcov_debug(ENGINE_MSG, "PT forked %d\n", child);
+		ChildMap_t::const_iterator child = m_children.find(m_activeChild);
 
-		/* Wait for the initial stop */
-		who = waitpid(child, &status, 0);
-		if (who < 0)
+		if (child == m_children.end())
+			return false;
+
+		pid_t tgid = child->second;
+
+		// The exit status can't be collected from a process which isn't our child
+		if (m_attached && tgid == m_firstChild)
+			return false;
+
+		LiveBreakpointMap_t::iterator it = m_liveBreakpoints.find(tgid);
+
+		if (it != m_liveBreakpoints.end() && it->second != 0)
+			return false;
+
+		// A SIGSTOP from us would stop it for good
+		for (ChildMap_t::const_iterator cur = m_children.begin(); cur != m_children.end(); ++cur)
 		{
-			perror("waitpid");
+			if (cur->second == tgid && m_pendingSigstops.find(cur->first) != m_pendingSigstops.end())
+				return false;
+		}
+
+		// New breakpoints from solibs which are being loaded
+		if (solibDataPending())
 			return false;
+
+		// Counted since exec. The memory can't be checked, since the addresses of other
+		// images can hold the breakpoint instruction by chance
+		if (m_exactLiveBreakpoints.find(tgid) != m_exactLiveBreakpoints.end())
+			return it != m_liveBreakpoints.end() && it->second == 0;
+
+		// Not seen before, or double-check before letting it run
+		m_liveBreakpoints[tgid] = countArmedBreakpoints();
+
+		return m_liveBreakpoints[tgid] == 0;
+	}
+
+	void detachAddressSpace()
+	{
+		pid_t tgid = m_children[m_activeChild];
+
+		stopOtherThreads();
+
+		// Threads with other events to handle first
+		for (StopList_t::const_iterator it = m_deferredStops.begin(); it != m_deferredStops.end(); ++it)
+		{
+			ChildMap_t::const_iterator cur = m_children.find(it->first);
+
+			if (cur != m_children.end() && cur->second == tgid)
+			{
+				resumeOtherThreads();
+				ptrace_sys::cont(m_activeChild, m_signal);
+
+				return;
+			}
 		}
-		if (!WIFSTOPPED(status))
+
+		kcov_debug(ENGINE_MSG, "PT no breakpoints left in %d, detaching %zu threads\n", tgid,
+				m_stoppedThreads.size() + 1);
+
+		m_stoppedThreads.push_back(m_activeChild);
+		for (PidList_t::const_iterator it = m_stoppedThreads.begin(); it != m_stoppedThreads.end(); ++it)
 		{
-			fprintf(stderr, "Child hasn't stopped: %x\n", status);
-			return false;
+			ptrace_sys::detach(*it);
+			m_children.erase(*it);
 		}
 
-		ptrace_sys::follow_fork(m_activeChild);
+		m_stoppedThreads.clear();
+		m_liveBreakpoints.erase(tgid);
+		m_exactLiveBreakpoints.erase(tgid);
+	}
 
-		return true;
+	/*
+	 * The solib handler preload sends the loaded solibs before each trap it
+	 * takes, so wait for the message of this trap, and let the collector parse
+	 * it before the process continues.
+	 */
+	void waitForSolibTrap(uint64_t addr)
+	{
+		pid_t tgid = m_multiCore || m_autoDetach ? m_children[m_activeChild] : ptrace_sys::get_tgid(m_activeChild);
+
+		// Raised by the program itself
+		if (!isSolibTrap(tgid, addr))
+			return;
+
+		unsigned int &traps = m_solibTraps[tgid];
+
+		traps = std::min(traps + 1, waitForSolibData(tgid, traps + 1));
+
+		m_syncWithCollector = m_coordinator != NULL;
 	}
 
-	bool attachPid(pid_t pid)
+	void forgetSolibTraps(pid_t pid)
+	{
+		m_solibTraps.erase(pid);
+		forgetSolibData(pid);
+	}
+
+	/*
+	 * After exec, the process has a new image without any breakpoints. Executables
+	 * are parsed the first time they are seen, and the breakpoints in them are armed
+	 * again each time they are exec'd. With --auto-detach, processes which exec a
+	 * program without covered code are detached from directly.
+	 */
+	void handleExec()
 	{
-		int rv;
+		struct phdr_data_entry image;
+		pid_t tgid = ptrace_sys::get_tgid(m_activeChild);
 
-		m_child = m_activeChild = m_firstChild = pid;
+		// The new program numbers its solib messages from the start
+		forgetSolibTraps(tgid);
+		m_enteredFunctions.erase(tgid);
 
-		errno = 0;
-		rv = ptrace_sys::attachAll(m_activeChild);
-		//rv = ptrace(PTRACE_ATTACH, m_activeChild, 0, 0);
-		if (rv < 0)
+		if (m_autoDetach)
 		{
-			const char *err = strerror(errno);
-
-			fprintf(stderr, "Can't attach to %d. Error %s\n", pid, err);
-			return false;
+			m_liveBreakpoints[tgid] = 0;
+			m_exactLiveBreakpoints.insert(tgid);
 		}
 
-		/* Wait for the initial stop */
-		int status;
-		int who = waitpid(m_activeChild, &status, 0);
-		if (who < 0)
+		if (!ptrace_sys::get_exec_image(m_activeChild, &image))
 		{
-			perror("waitpid");
-			return false;
+			kcov_debug(ENGINE_MSG, "PT can't read the exec'd image of %d\n", m_activeChild);
+			return;
 		}
-		if (!WIFSTOPPED(status))
+
+		// Parsed by the collector thread
+		if (m_coordinator)
+			rearmBreakpoints(m_coordinator->waitForExecImage(*this, image));
+		else
+			rearmBreakpoints(lookupExecImage(image));
+	}
+
+	// In the collector thread
+	PendingBreakpointList_t lookupExecImage(struct phdr_data_entry &image)
+	{
+		std::string id = execImageId(&image);
+
+		if (id == "")
+			return PendingBreakpointList_t();
+
+		ExecImageMap_t::const_iterator it = m_execImages.find(id);
+
+		if (it != m_execImages.end())
+			return it->second;
+
+		m_recordingExec = true;
+		parseExecImage(&image);
+		m_recordingExec = false;
+
+		PendingBreakpointList_t &out = m_execImages[id];
+
+		out.swap(m_execBreakpoints);
+		std::sort(out.begin(), out.end());
+		out.erase(std::unique(out.begin(), out.end()), out.end());
+
+		kcov_debug(ENGINE_MSG, "PT %zu breakpoints in exec'd %s\n", out.size(), image.name);
+
+		return out;
+	}
+
+	/*
+	 * Arm the known breakpoints of an image again. The original instructions in the
+	 * map are kept, so breakpoints where the new image has other code (e.g., another
+	 * executable at the same address) are skipped. New breakpoints are pending, and
+	 * armed as usual.
+	 */
+	void rearmBreakpoints(const PendingBreakpointList_t &breakpoints)
+	{
+		std::vector<bool> matches;
+		long armed = 0;
+
+		PendingBreakpointList_t::const_iterator first = breakpoints.begin();
+		while (first != breakpoints.end())
 		{
-			fprintf(stderr, "Child hasn't stopped: %x\n", status);
-			return false;
+			PendingBreakpointList_t::const_iterator last = first + 1;
+
+			while (last != breakpoints.end() && getPage(*last) - getPage(*(last - 1)) <= m_pageSize)
+				++last;
+
+			unsigned long start = getAligned(*first);
+			unsigned long end = getAligned(*(last - 1)) + sizeof(unsigned long);
+
+			m_textBuffer.resize((end - start) / sizeof(unsigned long));
+			if (!ptrace_sys::readMemory(m_activeChild, start, m_textBuffer.data(), end - start))
+			{
+				first = last;
+				continue;
+			}
+
+			// Compare with the unpatched text first
+			matches.clear();
+			for (PendingBreakpointList_t::const_iterator it = first; it != last; ++it)
+			{
+				const unsigned long *orig = m_instructionMap->lookup(*it);
+				unsigned long cur = m_textBuffer[(getAligned(*it) - start) / sizeof(unsigned long)];
+
+				matches.push_back(orig && arch_clearBreakpoint(*it, *orig, cur) == cur);
+			}
+
+			long n = 0;
+			for (PendingBreakpointList_t::const_iterator it = first; it != last; ++it)
+			{
+				unsigned long &cur = m_textBuffer[(getAligned(*it) - start) / sizeof(unsigned long)];
+
+				if (!matches[it - first])
+					continue;
+
+				cur = arch_setupBreakpoint(*it, cur);
+				n++;
+			}
+
+			if (n > 0 && ptrace_sys::writeMemory(m_activeChild, start, m_textBuffer.data(), end - start))
+				armed += n;
+
+			first = last;
 		}
-		ptrace_sys::tie_process_to_cpu(m_activeChild, m_parentCpu);
 
-		return true;
+		if (m_autoDetach)
+			updateLiveBreakpoints(armed);
+
+		kcov_debug(BP_MSG, "BP armed %ld of %zu breakpoints again after exec\n", armed, breakpoints.size());
 	}
 
-	typedef std::unordered_map<unsigned long, unsigned long> instructionMap_t;
-	typedef std::vector<unsigned long> PendingBreakpointList_t;
-	typedef std::unordered_map<pid_t, int> ChildMap_t;
+	/*
+	 * Return the next stopped child. Stops seen while stopping other threads are
+	 * returned first, and the SIGSTOPs sent by stopOtherThreads() are swallowed.
+	 */
+	pid_t waitStop(int *status)
+	{
+		while (true)
+		{
+			pid_t who;
+
+			if (!m_deferredStops.empty())
+			{
+				who = m_deferredStops.front().first;
+				*status = m_deferredStops.front().second;
+				m_deferredStops.pop_front();
+			}
+			else if (m_coordinator)
+			{
+				who = ptrace_sys::wait_thread(status);
+			}
+			else
+			{
+				who = ptrace_sys::wait_all(status);
+			}
+
+			if (who != -1 && WIFSTOPPED(*status) && WSTOPSIG(*status) == SIGSTOP &&
+					m_pendingSigstops.erase(who) > 0)
+			{
+				kcov_debug(ENGINE_MSG, "PT swallowing SIGSTOP for %d\n", who);
+
+				// Arm the next slice of breakpoints (see --pause-budget)
+				if (!m_pendingBreakpoints.empty())
+				{
+					m_activeChild = who;
+					setupAllBreakpoints();
+					requestArmingStop();
+				}
+
+				ptrace_sys::cont(who, 0);
+				continue;
+			}
+
+			return who;
+		}
+	}
+
+	bool hasDeferredStop(pid_t pid) const
+	{
+		for (StopList_t::const_iterator it = m_deferredStops.begin(); it != m_deferredStops.end(); ++it)
+		{
+			if (it->first == pid)
+				return true;
+		}
+
+		return false;
+	}
+
+	/*
+	 * In multi-core mode, stop all other threads in the address space of the active
+	 * child so that no thread executes the text while it's being patched.
+	 */
+	void stopOtherThreads()
+	{
+		ChildMap_t::const_iterator active = m_children.find(m_activeChild);
+
+		if (active == m_children.end())
+			return;
+
+		pid_t tgid = active->second;
+
+		for (ChildMap_t::const_iterator it = m_children.begin(); it != m_children.end(); ++it)
+		{
+			pid_t tid = it->first;
+			int status;
+
+			if (tid == m_activeChild || it->second != tgid || hasDeferredStop(tid))
+				continue;
+
+			if (ptrace_sys::stop_thread(tgid, tid) < 0)
+				continue;
+
+			if (ptrace_sys::wait_pid(tid, &status) != tid)
+				continue;
+
+			if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP)
+			{
+				// Also covers a SIGSTOP from requestArmingStop()
+				m_pendingSigstops.erase(tid);
+				m_stoppedThreads.push_back(tid);
+				continue;
+			}
+
+			// Something else happened first. Handle that later, and skip our SIGSTOP then
+			m_deferredStops.push_back(std::make_pair(tid, status));
+			if (WIFSTOPPED(status))
+				m_pendingSigstops.insert(tid);
+		}
+
+		kcov_debug(ENGINE_MSG, "PT stopped %zu threads for patching\n", m_stoppedThreads.size());
+	}
+
+	void resumeOtherThreads()
+	{
+		for (PidList_t::const_iterator it = m_stoppedThreads.begin(); it != m_stoppedThreads.end(); ++it)
+			ptrace_sys::cont(*it, 0);
+
+		m_stoppedThreads.clear();
+	}
+
+	/*
+	 * Tracer threads share the map with the tracer they were created from. Only the
+	 * owning thread copies the pointer, so a map which isn't shared can't become
+	 * shared while it's being modified.
+	 */
+	instructionMap_t &writableInstructionMap()
+	{
+		if (m_instructionMap.use_count() > 1)
+			m_instructionMap = std::make_shared<instructionMap_t>(*m_instructionMap);
+
+		return *m_instructionMap;
+	}
+
+	LazyBreakpointMap_t &writableLazyBreakpoints()
+	{
+		if (m_lazyBreakpoints.use_count() > 1)
+			m_lazyBreakpoints = std::make_shared<LazyBreakpointMap_t>(*m_lazyBreakpoints);
+
+		return *m_lazyBreakpoints;
+	}
+
+	/*
+	 * Register the deferred breakpoints of a function which has just been entered
+	 * in the address space of the active child. Other processes, e.g., forked
+	 * before the function was called, still have the entry breakpoint and get
+	 * the lines armed when they enter it. Lines which are already known have
+	 * been armed in another address space, so they are only patched in here.
+	 */
+	bool registerFunctionBreakpoints(unsigned long entry)
+	{
+		LazyBreakpointMap_t::const_iterator it = m_lazyBreakpoints->find(entry);
+
+		if (it == m_lazyBreakpoints->end())
+			return false;
+
+		// Another thread of the process got there first
+		if (!m_enteredFunctions[ptrace_sys::get_tgid(m_activeChild)].insert(entry).second)
+			return false;
+
+		const PendingBreakpointList_t &lines = it->second;
+		long armed = 0;
+
+		kcov_debug(BP_MSG, "BP function at 0x%lx entered by %d, %zu breakpoints\n", entry, m_activeChild, lines.size());
+
+		for (PendingBreakpointList_t::const_iterator line = lines.begin(); line != lines.end(); ++line)
+		{
+			if (!m_instructionMap->contains(*line))
+			{
+				registerBreakpoint(*line);
+				continue;
+			}
+
+			unsigned long cur = ptrace_sys::peekWord(m_activeChild, getAligned(*line));
+			unsigned long val = arch_setupBreakpoint(*line, cur);
+
+			// Already armed, e.g., again after an exec
+			if (val == cur)
+				continue;
+
+			ptrace_sys::pokeWord(m_activeChild, getAligned(*line), val);
+			armed++;
+		}
+
+		if (m_autoDetach)
+			updateLiveBreakpoints(armed);
+
+		return true;
+	}
+
+	bool functionEntered(unsigned long entry) const
+	{
+		for (EnteredFunctionMap_t::const_iterator it = m_enteredFunctions.begin(); it != m_enteredFunctions.end(); ++it)
+		{
+			if (it->second.find(entry) != it->second.end())
+				return true;
+		}
+
+		return false;
+	}
+
+	void setupAllBreakpoints()
+	{
+		if (m_coordinator)
+			takeIncomingBreakpoints();
+
+		if (m_pendingBreakpoints.empty())
+			return;
+
+		// Arm in address order, so that breakpoints close to each other are patched in one go
+		std::sort(m_pendingBreakpoints.begin(), m_pendingBreakpoints.end());
+
+		// Registered more than once before being armed
+		m_pendingBreakpoints.erase(std::unique(m_pendingBreakpoints.begin(), m_pendingBreakpoints.end()),
+				m_pendingBreakpoints.end());
+		m_pendingBreakpoints.erase(std::remove_if(m_pendingBreakpoints.begin(), m_pendingBreakpoints.end(),
+				[this](unsigned long addr) { return m_instructionMap->contains(addr); }),
+				m_pendingBreakpoints.end());
+
+		if (m_pendingBreakpoints.empty())
+			return;
+
+		uint64_t start = get_us_timestamp();
+
+		// Grow the map once for all of them
+		writableInstructionMap().reserve(m_instructionMap->size() + m_pendingBreakpoints.size());
+
+		if (m_multiCore)
+			stopOtherThreads();
+
+		PendingBreakpointList_t::const_iterator first = m_pendingBreakpoints.begin();
+		while (first != m_pendingBreakpoints.end())
+		{
+			PendingBreakpointList_t::const_iterator last = first + 1;
+
+			// Extend the range as long as the next breakpoint is on the same or the next page
+			while (last != m_pendingBreakpoints.end() &&
+					getPage(*last) - getPage(*(last - 1)) <= m_pageSize &&
+					(m_pauseBudget == 0 || getPage(*last) - getPage(*first) < maxSliceRange))
+				++last;
+
+			setupBreakpointRange(first, last);
+			first = last;
+
+			// Leave the rest for the next stop
+			if (m_pauseBudget != 0 && get_us_timestamp() - start >= m_pauseBudget)
+				break;
+		}
+
+		kcov_debug(BP_MSG, "BP armed %zu of %zu pending breakpoints\n",
+				(size_t) (first - m_pendingBreakpoints.begin()), m_pendingBreakpoints.size());
+		m_pendingBreakpoints.erase(m_pendingBreakpoints.begin(), first);
+
+		resumeOtherThreads();
+
+		m_longestPause = std::max(m_longestPause, get_us_timestamp() - start);
+	}
+
+	/*
+	 * If the pause budget left breakpoints unarmed, stop the active child again
+	 * to arm the next slice. The program runs a bit in between, and the SIGSTOP is
+	 * swallowed when the next slice has been armed.
+	 */
+	void requestArmingStop()
+	{
+		if (m_pendingBreakpoints.empty() || m_pendingSigstops.find(m_activeChild) != m_pendingSigstops.end())
+			return;
+
+		if (ptrace_sys::stop_thread(ptrace_sys::get_tgid(m_activeChild), m_activeChild) == 0)
+			m_pendingSigstops.insert(m_activeChild);
+	}
+
+	unsigned long getPage(unsigned long addr) const
+	{
+		return addr & ~(m_pageSize - 1);
+	}
+
+	/*
+	 * Read the text covering [first, last) once, patch all breakpoints in a local
+	 * copy and write it back. Falls back to the per-word peek/poke if the bulk
+	 * access fails.
+	 */
+	void setupBreakpointRange(PendingBreakpointList_t::const_iterator first,
+			PendingBreakpointList_t::const_iterator last)
+	{
+		unsigned long start = getAligned(*first);
+		unsigned long end = getAligned(*(last - 1)) + sizeof(unsigned long);
+		size_t size = end - start;
+
+		m_textBuffer.resize(size / sizeof(unsigned long));
+
+		bool haveText = ptrace_sys::readMemory(m_activeChild, start, m_textBuffer.data(), size);
+		instructionMap_t &instructionMap = writableInstructionMap();
+
+		// Save the original instructions before any of them are patched
+		for (PendingBreakpointList_t::const_iterator it = first; it != last; ++it)
+		{
+			unsigned long addr = *it;
+
+			if (haveText)
+				instructionMap[addr] = m_textBuffer[(getAligned(addr) - start) / sizeof(unsigned long)];
+			else
+				instructionMap[addr] = ptrace_sys::peekWord(m_activeChild, getAligned(addr));
+		}
+
+		if (haveText)
+		{
+			for (PendingBreakpointList_t::const_iterator it = first; it != last; ++it)
+			{
+				unsigned long addr = *it;
+				unsigned long &cur_data = m_textBuffer[(getAligned(addr) - start) / sizeof(unsigned long)];
+
+				cur_data = arch_setupBreakpoint(addr, cur_data);
+			}
+
+			if (ptrace_sys::writeMemory(m_activeChild, start, m_textBuffer.data(), size))
+			{
+				kcov_debug(BP_MSG, "BP armed %zu breakpoints in 0x%lx-0x%lx\n",
+						(size_t) (last - first), start, end);
+				if (m_autoDetach)
+					updateLiveBreakpoints(last - first);
+				return;
+			}
+		}
+
+		if (m_autoDetach)
+			updateLiveBreakpoints(last - first);
+
+		for (PendingBreakpointList_t::const_iterator it = first; it != last; ++it)
+		{
+			unsigned long addr = *it;
+			unsigned long cur_data = ptrace_sys::peekWord(m_activeChild, getAligned(addr));
+
+			// Set the breakpoint
+			ptrace_sys::pokeWord(m_activeChild, getAligned(addr), arch_setupBreakpoint(addr, cur_data));
+		}
+	}
+
+	bool startChild(const std::string &executable)
+	{
+		unsigned int pid = IConfiguration::getInstance().keyAsInt("attach-pid");
+
+		if (pid != 0)
+			return attachPid(pid);
+
+		return forkChild(executable.c_str());
+	}
+
+	/*
+	 * With --tracer-threads, each traced process gets a tracer thread of its own,
+	 * with a separate instance of this class. Ptrace requires the waiting thread
+	 * to be the one which attached, so new processes are detached (stopped) from
+	 * the parent tracer and attached again by the new thread. The collector thread
+	 * only dispatches the events which the tracers queue.
+	 */
+	struct TracerEvent
+	{
+		TracerEvent() : tracer(NULL), sync(false), done(false), exec(NULL)
+		{
+		}
+
+		Ptrace *tracer;
+		Event ev;
+		bool sync; // The tracer waits until the collector has handled the event
+		bool done; // The tracer has no processes left
+		struct phdr_data_entry *exec; // The tracer waits for the breakpoints of an exec'd image
+	};
+
+	typedef std::vector<Ptrace *> TracerList_t;
+
+	bool startTracerThreads(const std::string &executable)
+	{
+		Ptrace *root = createTracer(NULL, 0);
+
+		// Tracers mostly sleep in waitpid, but too many just add context switches
+		m_maxTracers = 4 * std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+
+		root->m_executable = executable;
+		root->m_firstBreakpoint = true;
+
+		m_liveTracers = 1;
+		m_tracers.push_back(root);
+		pthread_create(&root->m_thread, NULL, Ptrace::tracerThreadStatic, (void *) root);
+
+		// Wait for the fork/attach
+		m_syncSemaphore.wait();
+		if (!m_startOk)
+			return false;
+
+		m_activeChild = m_child = m_firstChild = root->m_firstChild;
+
+		// Let it run when the collector has registered the breakpoints
+		m_syncTracer = root;
+
+		return true;
+	}
+
+	Ptrace *createTracer(Ptrace *parent, pid_t pid)
+	{
+		Ptrace *out = new Ptrace();
+
+		out->m_coordinator = this;
+		out->m_tracerRoot = pid;
+		out->m_multiCore = m_multiCore;
+		out->m_basicBlockBreakpoints = m_basicBlockBreakpoints;
+		out->m_autoDetach = m_autoDetach;
+		out->m_attached = m_attached;
+		out->m_parentCpu = m_parentCpu;
+		out->m_firstBreakpoint = false;
+
+		if (!parent)
+			return out;
+
+		// Same text as in the parent, so share the map until one of them changes it
+		out->m_instructionMap = parent->m_instructionMap;
+		out->m_lazyBreakpoints = parent->m_lazyBreakpoints;
+		out->m_pendingBreakpoints = parent->m_pendingBreakpoints;
+		out->m_firstChild = parent->m_firstChild;
+		out->m_hitBreakpoints = parent->m_hitBreakpoints;
+
+		LiveBreakpointMap_t::iterator live = parent->m_liveBreakpoints.find(pid);
+
+		if (live != parent->m_liveBreakpoints.end())
+		{
+			out->m_liveBreakpoints.insert(*live);
+			parent->m_liveBreakpoints.erase(live);
+		}
+
+		std::lock_guard<std::mutex> lock(parent->m_incomingMutex);
+		out->m_incomingBreakpoints = parent->m_incomingBreakpoints;
+
+		return out;
+	}
+
+	static void *tracerThreadStatic(void *pThis)
+	{
+		Ptrace *p = (Ptrace *) pThis;
+
+		p->tracerThread();
+
+		return NULL;
+	}
+
+	void tracerThread()
+	{
+		if (m_tracerRoot == 0)
+		{
+			pid_t self = getpid();
+			bool res = startChild(m_executable);
+
+			// Exec failed in the forked child
+			if (getpid() != self)
+				_exit(1);
+
+			m_tracerRoot = m_firstChild;
+			m_coordinator->m_startOk = res;
+			m_coordinator->m_syncSemaphore.notify();
+
+			if (res)
+				m_syncSemaphore.wait();
+		}
+		else if (!adoptProcess(m_tracerRoot))
+		{
+			m_children.clear();
+		}
+
+		while (continueExecution())
+			;
+
+		kcov_debug(ENGINE_MSG, "PT tracer thread for %d done\n", m_tracerRoot);
+
+		TracerEvent done;
+
+		done.tracer = this;
+		done.done = true;
+		m_coordinator->m_events.push(done);
+		m_coordinator->m_eventSemaphore.notify();
+	}
+
+	// A new process which should get a tracer thread of its own?
+	bool isGroupStop(pid_t pid, int status)
+	{
+		return WIFSTOPPED(status) && ptrace_sys::eventIsGroupStop(WSTOPSIG(status), ptrace_sys::getEvent(pid, status));
+	}
+
+	/*
+	 * Ctrl-Z, kill -STOP etc. for seized processes (--pid). The process stays
+	 * stopped until it gets a SIGCONT, which is then reported like a signal.
+	 */
+	void listenGroupStop(pid_t pid)
+	{
+		kcov_debug(ENGINE_MSG, "PT group stop for %d\n", pid);
+
+		// Threads created during the stop are stopped right away
+		if (m_children.find(pid) == m_children.end())
+			m_children[pid] = m_multiCore || m_autoDetach ? ptrace_sys::get_tgid(pid) : pid;
+
+		ptrace_sys::listen(pid);
+	}
+
+	bool isNewProcess(pid_t pid)
+	{
+		if (!m_coordinator || pid == m_tracerRoot || m_children.find(pid) != m_children.end())
+			return false;
+
+		// Threads stay with the process
+		if (ptrace_sys::get_tgid(pid) != pid)
+			return false;
+
+		// If there are no threads left, the tracer keeps the process tree
+		return m_coordinator->reserveTracer();
+	}
+
+	void handOverProcess(pid_t pid)
+	{
+		kcov_debug(ENGINE_MSG, "PT handing over %d to a new tracer thread\n", pid);
+
+		ptrace_sys::detach_stopped(pid);
+		m_coordinator->startTracerThread(*this, pid);
+	}
+
+	bool reserveTracer()
+	{
+		std::lock_guard<std::mutex> lock(m_tracersMutex);
+
+		if (m_liveTracers >= m_maxTracers)
+			return false;
+		m_liveTracers++;
+
+		return true;
+	}
+
+	void startTracerThread(Ptrace &parent, pid_t pid)
+	{
+		std::lock_guard<std::mutex> lock(m_tracersMutex);
+		Ptrace *tracer = createTracer(&parent, pid);
+
+		m_tracers.push_back(tracer);
+		pthread_create(&tracer->m_thread, NULL, Ptrace::tracerThreadStatic, (void *) tracer);
+	}
+
+	int registerTracerBreakpoint(unsigned long entry, unsigned long addr)
+	{
+		std::lock_guard<std::mutex> lock(m_tracersMutex);
+
+		// There already?
+		if (m_instructionMap->contains(addr))
+			return 0;
+		(*m_instructionMap)[addr] = 0;
+
+		for (TracerList_t::iterator it = m_tracers.begin(); it != m_tracers.end(); ++it)
+		{
+			Ptrace *cur = *it;
+			std::lock_guard<std::mutex> tracerLock(cur->m_incomingMutex);
+
+			cur->m_incomingBreakpoints.push_back(std::make_pair(entry, addr));
+		}
+
+		return 0;
+	}
+
+	void takeIncomingBreakpoints()
+	{
+		IncomingBreakpointList_t incoming;
+
+		{
+			std::lock_guard<std::mutex> lock(m_incomingMutex);
+
+			incoming.swap(m_incomingBreakpoints);
+		}
+
+		for (IncomingBreakpointList_t::iterator it = incoming.begin(); it != incoming.end(); ++it)
+		{
+			if (it->first)
+				registerLazyBreakpoint(it->first, it->second);
+			else
+				registerBreakpoint(it->second);
+		}
+	}
+
+	// In the tracer thread
+	void forwardEvent(const Event &ev)
+	{
+		// The tracer thread is done when waitpid fails
+		if (ev.type == ev_error)
+			return;
+
+		TracerEvent tev;
+
+		tev.tracer = this;
+		tev.ev = ev;
+		tev.sync = m_syncWithCollector;
+		m_syncWithCollector = false;
+
+		m_coordinator->m_events.push(tev);
+		m_coordinator->m_eventSemaphore.notify();
+
+		if (tev.sync)
+			m_syncSemaphore.wait();
+	}
+
+	// In the tracer thread
+	PendingBreakpointList_t waitForExecImage(Ptrace &tracer, struct phdr_data_entry &image)
+	{
+		TracerEvent tev;
+
+		tev.tracer = &tracer;
+		tev.exec = &image;
+
+		m_events.push(tev);
+		m_eventSemaphore.notify();
+		tracer.m_syncSemaphore.wait();
+
+		PendingBreakpointList_t out;
+
+		out.swap(tracer.m_execBreakpoints);
+
+		return out;
+	}
+
+	// In the collector thread
+	bool dispatchTracerEvent()
+	{
+		TracerEvent tev;
+
+		// The collector has handled the last event, so the tracer can continue
+		if (m_syncTracer)
+		{
+			m_syncTracer->m_syncSemaphore.notify();
+			m_syncTracer = NULL;
+		}
+
+		while (!m_events.pop(tev))
+			m_eventSemaphore.wait();
+
+		// Handle everything queued, but stop at events the tracer waits for
+		do
+		{
+			if (tev.done)
+			{
+				if (!tracerDone(tev.tracer))
+					return false;
+				continue;
+			}
+
+			if (tev.exec)
+			{
+				tev.tracer->m_execBreakpoints = lookupExecImage(*tev.exec);
+				tev.tracer->m_syncSemaphore.notify();
+				continue;
+			}
+
+			m_listener->onEvent(tev.ev);
+
+			if (tev.sync)
+			{
+				m_syncTracer = tev.tracer;
+				break;
+			}
+		} while (m_events.pop(tev));
+
+		return true;
+	}
+
+	bool tracerDone(Ptrace *tracer)
+	{
+		std::lock_guard<std::mutex> lock(m_tracersMutex);
+
+		pthread_join(tracer->m_thread, NULL);
+		m_tracers.erase(std::find(m_tracers.begin(), m_tracers.end(), tracer));
+		delete tracer;
+
+		// Same as when waitpid fails without tracer threads
+		if (--m_liveTracers == 0)
+		{
+			m_listener->onEvent(Event(ev_error, -1));
+			return false;
+		}
+
+		return true;
+	}
+
+	bool forkChild(const char *executable)
+	{
+		char * const *argv = (char * const *) IConfiguration::getInstance().getArgv();
+		pid_t child, who;
+		int status;
+
+		/* Executable exists, try to launch it */
+		if ((child = fork()) == 0)
+		{
+			int res;
+
+			/* Avoid address randomization */
+			if (!ptrace_sys::disable_aslr())
+				return false;
+
+			/* And launch the process */
+			res = ptrace_sys::trace_me();
+			if (res < 0)
+			{
+				perror("Can't set me as ptraced");
+				return false;
+			}
+			if (!m_multiCore)
+				ptrace_sys::tie_process_to_cpu(getpid(), m_parentCpu);
+			execv(executable, argv);
+
+			/* Exec failed */
+			return false;
+		}
+
+		/* Fork error? */
+		if (child < 0)
+		{
+			perror("fork");
+			return false;
+		}
+		m_child = m_activeChild = m_firstChild = child;
+		// Nothing armed yet
+		m_liveBreakpoints[child] = 0;
+		// Might not be completely necessary (the child should inherit this
+		// from the parent), but better safe than sorry
+		if (!m_multiCore)
+			ptrace_sys::tie_process_to_cpu(m_child, m_parentCpu);
+
+		kcov_debug(ENGINE_MSG, "PT forked %d\n", child);
+
+		/* Wait for the initial stop */
+		who = ptrace_sys::wait_pid(child, &status);
+		if (who < 0)
+		{
+			perror("waitpid");
+			return false;
+		}
+		if (!WIFSTOPPED(status))
+		{
+			fprintf(stderr, "Child hasn't stopped: %x\n", status);
+			return false;
+		}
+
+		ptrace_sys::follow_fork(m_activeChild);
+
+		return true;
+	}
+
+	bool attachPid(pid_t pid)
+	{
+		uint64_t start = get_us_timestamp();
+		int threads;
+
+		m_firstChild = pid;
+		m_child = m_activeChild = pid;
+		m_liveBreakpoints[pid] = 0;
+
+		errno = 0;
+		threads = ptrace_sys::attachAll(pid);
+		if (threads < 0)
+		{
+			const char *err = strerror(errno);
+
+			fprintf(stderr, "Can't attach to %d. Error %s\n", pid, err);
+			return false;
+		}
+
+		if (!waitForAttach(pid))
+			return false;
+
+		kcov_debug(ENGINE_MSG, "PT attached to %d (%d threads) in %.2f ms\n", pid, threads,
+				(get_us_timestamp() - start) / 1000.0);
+
+		return true;
+	}
+
+	// In a tracer thread, for a process detached by another tracer
+	bool adoptProcess(pid_t pid)
+	{
+		kcov_debug(ENGINE_MSG, "PT tracer thread attaching to %d\n", pid);
+
+		m_child = m_activeChild = pid;
+
+		errno = 0;
+		if (ptrace_sys::attach(pid) < 0)
+		{
+			const char *err = strerror(errno);
+
+			fprintf(stderr, "Can't attach to %d. Error %s\n", pid, err);
+			return false;
+		}
+
+		if (!waitForAttach(pid))
+			return false;
+
+		// Can't be done until the process has stopped
+		ptrace_sys::follow_fork(pid);
+
+		return leaveGroupStop(pid);
+	}
+
+	/*
+	 * The SIGSTOP of the handover stops the process as a group, and it stays in
+	 * that group stop while traced. Detaching from it later, e.g., with --auto-detach,
+	 * would then leave it stopped for good. A SIGCONT ends the group stop (and
+	 * discards the SIGSTOP of the attach), and is swallowed here.
+	 */
+	bool leaveGroupStop(pid_t pid)
+	{
+		int status;
+
+		::kill(pid, SIGCONT);
+		ptrace_sys::cont(pid, 0);
+
+		if (ptrace_sys::wait_pid(pid, &status) < 0 || !WIFSTOPPED(status))
+			return false;
+
+		// Something else came first, so let it be delivered after all
+		if (WSTOPSIG(status) != SIGCONT)
+		{
+			kcov_debug(ENGINE_MSG, "PT signal %d for %d while adopting\n", WSTOPSIG(status), pid);
+			::kill(pid, WSTOPSIG(status));
+		}
+
+		return true;
+	}
+
+	bool waitForAttach(pid_t pid)
+	{
+		/* Wait for the initial stop */
+		int status;
+		int who = ptrace_sys::wait_pid(pid, &status);
+		if (who < 0)
+		{
+			perror("waitpid");
+			return false;
+		}
+		if (!WIFSTOPPED(status))
+		{
+			fprintf(stderr, "Child hasn't stopped: %x\n", status);
+			return false;
+		}
+		if (!m_multiCore)
+			ptrace_sys::tie_process_to_cpu(pid, m_parentCpu);
+
+		return true;
+	}
 
-	instructionMap_t m_instructionMap;
+	std::shared_ptr<instructionMap_t> m_instructionMap;
+	std::shared_ptr<LazyBreakpointMap_t> m_lazyBreakpoints;
+	EnteredFunctionMap_t m_enteredFunctions;
 	PendingBreakpointList_t m_pendingBreakpoints;
+	std::vector<unsigned long> m_textBuffer;
+	unsigned long m_pageSize;
 	bool m_firstBreakpoint;
 
 	pid_t m_activeChild;
 	pid_t m_child;
 	pid_t m_firstChild;
 	ChildMap_t m_children;
+	StopList_t m_deferredStops;
+	PidList_t m_stoppedThreads;
+	PidSet_t m_pendingSigstops;
 
 	int m_parentCpu;
+	bool m_multiCore;
+	bool m_basicBlockBreakpoints;
+	bool m_autoDetach;
+	bool m_attached;
+	LiveBreakpointMap_t m_liveBreakpoints;
+	PidSet_t m_exactLiveBreakpoints;
+	PendingBreakpointList_t m_sortedBreakpoints;
+	AddressSet_t m_hitBreakpoints;
+	BasicBlockMap_t m_basicBlocks;
+	std::mutex m_basicBlocksMutex;
 
 	IEventListener *m_listener;
 	int m_signal;
+	unsigned long m_breakpointStops;
+	uint64_t m_lastSignalAddress;
+	uint64_t m_pauseBudget; // us
+	uint64_t m_longestPause;
+
+	// For tracer threads
+	Ptrace *m_coordinator;
+	bool m_tracerThreads;
+	pid_t m_tracerRoot;
+	std::string m_executable;
+	pthread_t m_thread;
+	Semaphore m_syncSemaphore;
+	bool m_syncWithCollector;
+	std::mutex m_incomingMutex;
+	IncomingBreakpointList_t m_incomingBreakpoints;
+
+	// For the collector side of tracer threads
+	MpscQueue<TracerEvent> m_events;
+	Semaphore m_eventSemaphore;
+	Ptrace *m_syncTracer;
+	std::mutex m_tracersMutex;
+	TracerList_t m_tracers;
+	unsigned int m_liveTracers;
+	unsigned int m_maxTracers;
+	bool m_startOk;
+	std::atomic<bool> m_firstChildExited;
+
+	// Exec'd images, parsed by the collector thread
+	ExecImageMap_t m_execImages;
+	SolibTrapMap_t m_solibTraps;
+	bool m_recordingExec;
+	PendingBreakpointList_t m_execBreakpoints; // While parsing, or the result for a tracer thread
 };
 
 class PtraceEngineCreator : public IEngineFactory::IEngineCreator
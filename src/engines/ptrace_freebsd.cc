@@ -1,16 +1,31 @@
 #include <sys/types.h>
 #include <sys/ptrace.h>
+#include <sys/sysctl.h>
 #include <sys/wait.h>
 
 #include <errno.h>
+#include <link.h>
+#include <signal.h>
+#include <string.h>
+
+#include <vector>
+
+#include <phdr_data.h>
 
 #include "ptrace_sys.hh"
 
 static void arch_adjustPcAfterBreakpoint(struct reg *regs);
 unsigned long arch_getPcFromRegs(struct reg *regs);
+static struct reg *getCachedRegs(pid_t pid);
 static unsigned long getPcFromRegs(struct reg *regs);
 static long getRegs(pid_t pid, void *addr, struct reg *regs);
 static long setRegs(pid_t pid, void *addr, struct reg *regs);
+static pid_t waitForStop(pid_t pid, int *status);
+
+// Registers of the currently stopped thread, read at most once per stop
+static struct reg cachedRegs;
+static pid_t cachedRegsPid = -1;
+static unsigned long registerAccesses;
 
 
 static void
@@ -32,10 +47,17 @@ unsigned long arch_getPcFromRegs(struct reg *regs)
 #endif
 }
 
+int
+ptrace_sys::attach(pid_t pid)
+{
+	return ptrace(PT_ATTACH, pid, 0, 0);
+}
+
 int
 ptrace_sys::attachAll (pid_t pid)
 {
-	return (ptrace(PT_ATTACH, pid, 0, 0) < 0 ? errno: 0);
+	// Threads are not traced separately
+	return (ptrace(PT_ATTACH, pid, 0, 0) < 0 ? -1 : 1);
 }
 
 int
@@ -50,6 +72,12 @@ ptrace_sys::detach(pid_t pid)
 	ptrace(PT_DETACH, pid, 0, 0);
 }
 
+void
+ptrace_sys::detach_stopped(pid_t pid)
+{
+	ptrace(PT_DETACH, pid, (caddr_t)1, SIGSTOP);
+}
+
 bool
 ptrace_sys::disable_aslr(void)
 {
@@ -68,6 +96,25 @@ ptrace_sys::eventIsNewChild(int signal, int event)
 	return (signal == SIGSTOP && (event & PL_FLAG_CHILD));
 }
 
+bool
+ptrace_sys::eventIsGroupStop(int signal, int event)
+{
+	// Only for seized processes, which FreeBSD doesn't have
+	return false;
+}
+
+int
+ptrace_sys::listen(pid_t pid)
+{
+	return -1;
+}
+
+bool
+ptrace_sys::eventIsExec(int signal, int event)
+{
+	return (signal == SIGTRAP && (event & PL_FLAG_EXEC));
+}
+
 int
 ptrace_sys::follow_child(pid_t pid)
 {
@@ -80,6 +127,68 @@ ptrace_sys::follow_fork(pid_t pid)
 	return ptrace(PT_FOLLOW_FORK, pid, NULL, 1);
 }
 
+bool
+ptrace_sys::get_exec_image(pid_t pid, struct phdr_data_entry *out)
+{
+	int pathMib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PATHNAME, pid };
+	int auxvMib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_AUXV, pid };
+	Elf_Auxinfo auxv[64];
+	unsigned long phdrAddr = 0;
+	unsigned long phnum = 0;
+	unsigned long relocation = 0;
+	size_t len;
+
+	memset(out, 0, sizeof(*out));
+
+	len = sizeof(out->name) - 1;
+	if (sysctl(pathMib, 4, out->name, &len, NULL, 0) < 0)
+		return false;
+
+	len = sizeof(auxv);
+	if (sysctl(auxvMib, 4, auxv, &len, NULL, 0) < 0)
+		return false;
+
+	for (size_t i = 0; i < len / sizeof(auxv[0]) && auxv[i].a_type != AT_NULL; i++)
+	{
+		if (auxv[i].a_type == AT_PHDR)
+			phdrAddr = auxv[i].a_un.a_val;
+		else if (auxv[i].a_type == AT_PHNUM)
+			phnum = auxv[i].a_un.a_val;
+	}
+
+	if (phdrAddr == 0 || phnum == 0)
+		return false;
+
+	std::vector<Elf_Phdr> phdrs(phnum);
+
+	if (!ptrace_sys::readMemory(pid, phdrAddr, phdrs.data(), phnum * sizeof(Elf_Phdr)))
+		return false;
+
+	for (size_t i = 0; i < phdrs.size(); i++)
+	{
+		if (phdrs[i].p_type == PT_PHDR)
+			relocation = phdrAddr - phdrs[i].p_vaddr;
+	}
+
+	for (size_t i = 0; i < phdrs.size(); i++)
+	{
+		struct phdr_data_segment *seg;
+
+		if (phdrs[i].p_type != PT_LOAD)
+			continue;
+
+		if (out->n_segments >= sizeof(out->segments) / sizeof(out->segments[0]))
+			return false;
+
+		seg = &out->segments[out->n_segments++];
+		seg->paddr = phdrs[i].p_paddr;
+		seg->vaddr = relocation + phdrs[i].p_vaddr;
+		seg->size = phdrs[i].p_memsz;
+	}
+
+	return true;
+}
+
 int
 ptrace_sys::getEvent(pid_t pid, int status)
 {
@@ -88,12 +197,44 @@ ptrace_sys::getEvent(pid_t pid, int status)
 	return (lwpinfo.pl_flags);
 }
 
+pid_t
+ptrace_sys::getEventChild(pid_t pid)
+{
+	struct ptrace_lwpinfo lwpinfo;
+
+	if (ptrace(PT_LWPINFO, pid, (caddr_t)&lwpinfo, sizeof(lwpinfo)) < 0)
+		return -1;
+	return (lwpinfo.pl_child_pid);
+}
+
 unsigned long
 ptrace_sys::getPc(int pid)
 {
-	struct reg regs;
-	getRegs(pid, NULL, &regs);
-	return getPcFromRegs(&regs);
+	struct reg *regs = getCachedRegs(pid);
+
+	if (!regs)
+		return 0;
+
+	return getPcFromRegs(regs);
+}
+
+static struct reg *
+getCachedRegs(pid_t pid)
+{
+	if (cachedRegsPid != pid)
+	{
+		if (getRegs(pid, NULL, &cachedRegs) < 0)
+			return NULL;
+		cachedRegsPid = pid;
+	}
+
+	return &cachedRegs;
+}
+
+unsigned long
+ptrace_sys::getRegisterAccesses(void)
+{
+	return registerAccesses;
 }
 
 int
@@ -102,6 +243,20 @@ ptrace_sys::get_current_cpu(void)
 	return 0;
 }
 
+bool
+ptrace_sys::has_tracer_threads(void)
+{
+	// The tracer is the process, so all threads would see all events
+	return false;
+}
+
+pid_t
+ptrace_sys::get_tgid(pid_t pid)
+{
+	// Threads are not traced as separate processes
+	return pid;
+}
+
 static unsigned long
 getPcFromRegs(struct reg *regs)
 {
@@ -111,6 +266,8 @@ getPcFromRegs(struct reg *regs)
 static long
 getRegs(pid_t pid, void *addr, struct reg *regs)
 {
+	registerAccesses++;
+
 	return ptrace(PT_GETREGS, pid, (caddr_t)regs, 0);
 }
 
@@ -143,9 +300,28 @@ ptrace_sys::pokeWord(pid_t pid, unsigned long aligned_addr, unsigned long value)
 	ptrace(PT_IO, pid, (caddr_t)&ptiod, 0);
 }
 
+bool
+ptrace_sys::readMemory(pid_t pid, unsigned long addr, void *buf, size_t len)
+{
+	struct ptrace_io_desc ptiod =
+	{
+		.piod_op = PIOD_READ_I,
+		.piod_offs = (void*)addr,
+		.piod_addr = buf,
+		.piod_len = len
+	};
+
+	if (ptrace(PT_IO, pid, (caddr_t)&ptiod, 0) < 0)
+		return false;
+
+	return ptiod.piod_len == len;
+}
+
 static long
 setRegs(pid_t pid, void *addr, struct reg *regs)
 {
+	registerAccesses++;
+
 	return ptrace(PT_SETREGS, pid, (caddr_t)regs, 0);
 }
 
@@ -153,10 +329,12 @@ void
 ptrace_sys::singleStep(pid_t pid)
 {
 	// Step back one instruction
-	struct reg regs;
-	getRegs(pid, NULL, &regs);
-	arch_adjustPcAfterBreakpoint(&regs);
-	setRegs(pid, NULL, &regs);
+	struct reg *regs = getCachedRegs(pid);
+
+	if (!regs)
+		return;
+	arch_adjustPcAfterBreakpoint(regs);
+	setRegs(pid, NULL, regs);
 }
 
 // Skip over this instruction
@@ -166,6 +344,12 @@ ptrace_sys::skipInstruction(pid_t pid)
 	// Nop on x86 and x86_64
 }
 
+int
+ptrace_sys::stop_thread(pid_t tgid, pid_t tid)
+{
+	return kill(tid, SIGSTOP);
+}
+
 void
 ptrace_sys::tie_process_to_cpu(pid_t pid, int cpu)
 {
@@ -180,5 +364,43 @@ ptrace_sys::trace_me(void)
 pid_t
 ptrace_sys::wait_all(int *status)
 {
-	return waitpid(-1, status, WSTOPPED);
+	return waitForStop(-1, status);
+}
+
+int
+ptrace_sys::wait_pid(pid_t pid, int *status)
+{
+	return waitForStop(pid, status);
+}
+
+int
+ptrace_sys::wait_thread(int *status)
+{
+	return ptrace_sys::wait_all(status);
+}
+
+// The only place where the register cache is invalidated: all stops are collected here
+static pid_t
+waitForStop(pid_t pid, int *status)
+{
+	cachedRegsPid = -1;
+
+	return waitpid(pid, status, WSTOPPED);
+}
+
+bool
+ptrace_sys::writeMemory(pid_t pid, unsigned long addr, const void *buf, size_t len)
+{
+	struct ptrace_io_desc ptiod =
+	{
+		.piod_op = PIOD_WRITE_I,
+		.piod_offs = (void*)addr,
+		.piod_addr = (void*)buf,
+		.piod_len = len
+	};
+
+	if (ptrace(PT_IO, pid, (caddr_t)&ptiod, 0) < 0)
+		return false;
+
+	return ptiod.piod_len == len;
 }
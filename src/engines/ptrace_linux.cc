@@ -1,6 +1,8 @@
 #include <sys/types.h>
 #include <sys/personality.h>
 #include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
 #include <sys/wait.h>
 
 #if defined(__aarch64__) || defined(__loongarch__)
@@ -9,10 +11,19 @@
 #endif
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
 #include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
-#include <unordered_map>
+#include <unistd.h>
+#include <atomic>
+#include <unordered_set>
+#include <vector>
+
+#include <phdr_data.h>
 
 #include "ptrace_sys.hh"
 #include "utils.hh"
@@ -23,70 +34,132 @@ enum
 	riscv_EPC = 0, loongarch_ERA = 33, sparc64_TPC = 2
 };
 
-static void arch_adjustPcAfterBreakpoint(unsigned long *regs);
-static unsigned long arch_getPcFromRegs(unsigned long *regs);
+static unsigned long arch_adjustPcAfterBreakpoint(unsigned long pc);
+static unsigned long arch_getBreakpointPc(unsigned long pc);
 static int attachLwp(int lwpid);
-static unsigned long getPcFromRegs(unsigned long *regs);
-static long getRegs(pid_t pid, void *addr, void *regs, size_t len);
+static unsigned long getPcRegister(pid_t pid);
 static int kill_lwp(unsigned long lwpid, int signo);
 static int linux_proc_get_int(pid_t lwpid, const char *field);
 static int linux_proc_pid_has_state(pid_t pid, const char *state);
 static int linux_proc_pid_is_stopped(pid_t pid);
 static int linux_proc_get_tgid(pid_t lwpid);
+static int openMemory(pid_t pid, int flags);
+static int seizeLwp(int lwpid);
+static void setPcRegister(pid_t pid, unsigned long pc);
+static pid_t waitForStop(pid_t pid, int *status, int options);
+#if !defined(__i386__) && !defined(__x86_64__)
+static long getRegs(pid_t pid, void *addr, void *regs, size_t len);
 static long setRegs(pid_t pid, void *addr, void *regs, size_t len);
+#endif
 
-static void arch_adjustPcAfterBreakpoint(unsigned long *regs)
-{
+/*
+ * Register cache for the currently stopped thread. The PC is fetched once per
+ * stop and only written back if it's changed. On x86, only the PC is accessed
+ * (via PEEKUSER/POKEUSER), on other architectures the smallest possible
+ * register set is transferred.
+ *
+ * The cache is per tracer thread (see --tracer-threads).
+ */
 #if defined(__i386__)
-	regs[i386_EIP]--;
+# define PC_USER_OFFSET offsetof(struct user_regs_struct, eip)
 #elif defined(__x86_64__)
-	regs[x86_64_RIP]--;
+# define PC_USER_OFFSET offsetof(struct user_regs_struct, rip)
+#elif defined(__aarch64__)
+static thread_local unsigned long cachedRegs[sizeof(struct user_regs_struct) / sizeof(unsigned long)];
+#else
+static thread_local unsigned long cachedRegs[1024];
+#endif
+static thread_local pid_t cachedRegsPid = -1;
+static thread_local unsigned long cachedPc;
+static std::atomic<unsigned long> registerAccesses;
+
+// Forks, clones and execs of the tracees are reported as events
+static const int traceOptions = PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC;
+
+static unsigned long arch_adjustPcAfterBreakpoint(unsigned long pc)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return pc - 1;
 #elif defined(__powerpc__) || defined(__arm__) || defined(__aarch64__) || defined(__riscv) || defined(__loongarch__) || (defined(__sparc__) && defined(__arch64__))
 	// Do nothing
+	return pc;
 #else
 # error Unsupported architecture
 #endif
 }
 
-static unsigned long arch_getPcFromRegs(unsigned long *regs)
+static unsigned long arch_getBreakpointPc(unsigned long pc)
 {
-	unsigned long out;
+#if defined(__i386__) || defined(__x86_64__)
+	return pc - 1;
+#else
+	return pc;
+#endif
+}
 
-#if defined(__i386__)
-	out = regs[i386_EIP] - 1;
-#elif defined(__x86_64__)
-	out = regs[x86_64_RIP] - 1;
-#elif defined(__arm__)
-	out = regs[arm_PC];
+#if !defined(__i386__) && !defined(__x86_64__)
+static unsigned long *arch_pcInRegs(unsigned long *regs)
+{
+#if defined(__arm__)
+	return &regs[arm_PC];
 #elif defined(__aarch64__)
-	out = regs[aarch64_PC];
+	return &regs[aarch64_PC];
 #elif defined(__powerpc__)
-	out = regs[ppc_NIP];
+	return &regs[ppc_NIP];
 #elif defined(__riscv)
-	out = regs[riscv_EPC];
+	return &regs[riscv_EPC];
 #elif defined(__loongarch__)
-	out = regs[loongarch_ERA];
+	return &regs[loongarch_ERA];
 #elif defined(__sparc__) && defined(__arch64__)
-	out = regs[sparc64_TPC];
+	return &regs[sparc64_TPC];
 #else
 # error Unsupported architecture
 #endif
+}
+#endif
 
-	return out;
+int ptrace_sys::attach(pid_t pid)
+{
+	int err = attachLwp(pid);
+
+	if (err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+
+	return 0;
 }
 
+/*
+ * PTRACE_SEIZE doesn't stop the threads, so the task list is scanned while the
+ * process keeps running. The clone/fork options are set by the seize itself, so
+ * threads created by already seized threads are traced automatically, and only
+ * threads created by the others have to be found by another scan. When all are
+ * seized, they are stopped with PTRACE_INTERRUPT, without checking their state
+ * in /proc.
+ */
 int ptrace_sys::attachAll(pid_t pid)
 {
 	int err;
 
-	/* Attach to PID.  We will check for other threads soon. */
-	err = attachLwp(pid);
+	err = seizeLwp(pid);
 	if (err != 0)
-		error("Cannot attach to process %d\n", pid);
+	{
+		errno = err;
+		return -1;
+	}
+
+	std::vector<pid_t> threads;
 
+	threads.push_back(pid);
+
+	// Attached to a thread, not the thread group
 	if (linux_proc_get_tgid(pid) != pid)
 	{
-		return 0;
+		ptrace(PTRACE_INTERRUPT, pid, 0, 0);
+
+		return 1;
 	}
 
 	DIR *dir;
@@ -99,57 +172,51 @@ int ptrace_sys::attachAll(pid_t pid)
 	if (!dir)
 	{
 		error("Could not open /proc/%d/task.\n", pid);
+		ptrace(PTRACE_INTERRUPT, pid, 0, 0);
 
-		return 0;
+		return 1;
 	}
 
-	/* At this point we attached to the tgid.  Scan the task for
-	 * existing threads. */
-	int new_threads_found;
-	int iterations = 0;
+	std::unordered_set<pid_t> seen;
+	bool newThreadsFound = true;
 
-	std::unordered_map<unsigned long, bool> threads;
-	threads[pid] = true;
+	seen.insert(pid);
 
-	while (iterations < 2)
+	// Threads created after a scan which finds nothing new have a seized parent
+	while (newThreadsFound)
 	{
 		struct dirent *dp;
 
-		new_threads_found = 0;
-		/* Add all the other threads.  While we go through the
-		 * threads, new threads may be spawned.  Cycle through
-		 * the list of threads until we have done two iterations without
-		 * finding new threads.  */
+		newThreadsFound = false;
 		while ((dp = readdir(dir)) != NULL)
 		{
-			int lwp;
+			pid_t lwp = strtoul(dp->d_name, NULL, 10);
 
-			/* Fetch one lwp.  */
-			lwp = strtoul(dp->d_name, NULL, 10);
+			if (lwp == 0 || !seen.insert(lwp).second)
+				continue;
 
-			/* Is this a new thread?  */
-			if (lwp != 0 && threads.find(lwp) == threads.end())
-			{
-				int err;
-				threads[lwp] = true;
+			newThreadsFound = true;
 
-				err = attachLwp(lwp);
-				if (err != 0)
-					warning("Cannot attach to lwp %d\n", lwp);
-
-				new_threads_found++;
-			}
+			// Fails for threads which are already traced since their parent was seized
+			if (seizeLwp(lwp) == 0)
+				threads.push_back(lwp);
 		}
 
-		if (!new_threads_found)
-			iterations++;
-		else
-			iterations = 0;
-
 		rewinddir(dir);
 	}
 	closedir(dir);
 
+	for (std::vector<pid_t>::const_iterator it = threads.begin(); it != threads.end(); ++it)
+		ptrace(PTRACE_INTERRUPT, *it, 0, 0);
+
+	return seen.size();
+}
+
+static int seizeLwp(int lwpid)
+{
+	if (ptrace(PTRACE_SEIZE, lwpid, 0, traceOptions) < 0)
+		return errno;
+
 	return 0;
 }
 
@@ -162,7 +229,7 @@ static int attachLwp(int lwpid)
 
 	if (rv < 0)
 		return errno;
-	ptrace(PTRACE_SETOPTIONS, lwpid, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+	ptrace(PTRACE_SETOPTIONS, lwpid, 0, traceOptions);
 
 	if (!linux_proc_pid_is_stopped(lwpid))
 	{
@@ -185,11 +252,23 @@ int ptrace_sys::cont(pid_t pid, int signal)
 	return ptrace(PTRACE_CONT, pid, 0, signal);
 }
 
+int ptrace_sys::listen(pid_t pid)
+{
+	return ptrace(PTRACE_LISTEN, pid, 0, 0);
+}
+
 void ptrace_sys::detach(pid_t pid)
 {
 	ptrace(PTRACE_DETACH, pid, 0, 0);
 }
 
+void ptrace_sys::detach_stopped(pid_t pid)
+{
+	// Queued instead of passed to PTRACE_DETACH, which ignores it for event stops
+	kill_lwp(pid, SIGSTOP);
+	ptrace(PTRACE_DETACH, pid, 0, 0);
+}
+
 bool ptrace_sys::disable_aslr(void)
 {
 	int persona = personality(0xffffffff);
@@ -214,7 +293,19 @@ bool ptrace_sys::eventIsForky(int signal, int event)
 
 bool ptrace_sys::eventIsNewChild(int signal, int event)
 {
-	return false;
+	// Seized threads (and their children) report an event stop instead of SIGSTOP
+	return event == PTRACE_EVENT_STOP && signal == SIGTRAP;
+}
+
+bool ptrace_sys::eventIsGroupStop(int signal, int event)
+{
+	return event == PTRACE_EVENT_STOP &&
+			(signal == SIGSTOP || signal == SIGTSTP || signal == SIGTTIN || signal == SIGTTOU);
+}
+
+bool ptrace_sys::eventIsExec(int signal, int event)
+{
+	return (signal == SIGTRAP && event == PTRACE_EVENT_EXEC);
 }
 
 int ptrace_sys::follow_child(pid_t pid)
@@ -224,7 +315,7 @@ int ptrace_sys::follow_child(pid_t pid)
 
 int ptrace_sys::follow_fork(pid_t pid)
 {
-	return ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK);
+	return ptrace(PTRACE_SETOPTIONS, pid, 0, traceOptions);
 }
 
 /* Return non-zero if 'State' of /proc/PID/status contains STATE.  */
@@ -236,12 +327,10 @@ static int linux_proc_get_int(pid_t lwpid, const char *field)
 	int retval = -1;
 
 	snprintf(buf, sizeof(buf), "/proc/%d/status", (int) lwpid);
+	// Not an error, threads can exit at any time
 	status_file = fopen(buf, "r");
 	if (status_file == NULL)
-	{
-		warning("unable to open /proc file '%s'", buf);
 		return -1;
-	}
 
 	while (fgets(buf, sizeof(buf), status_file))
 	{
@@ -304,27 +393,163 @@ int ptrace_sys::get_current_cpu(void)
 	return sched_getcpu();
 }
 
+bool ptrace_sys::has_tracer_threads(void)
+{
+	// The tracer is the thread which attached, and __WNOTHREAD limits waitpid to it
+	return true;
+}
+
+pid_t ptrace_sys::get_tgid(pid_t pid)
+{
+	int tgid = linux_proc_get_tgid(pid);
+
+	// Exited already, treat it as a process of its own
+	if (tgid <= 0)
+		return pid;
+
+	return tgid;
+}
+
+/*
+ * The kernel has mapped the new executable when the exec event is reported, so
+ * the segments are taken from the program headers in memory, like ld.so does.
+ */
+bool ptrace_sys::get_exec_image(pid_t pid, struct phdr_data_entry *out)
+{
+	unsigned long phdrAddr = 0;
+	unsigned long phnum = 0;
+	ElfW(auxv_t) auxv;
+	char path[64];
+	ssize_t r;
+	int fd;
+
+	memset(out, 0, sizeof(*out));
+
+	xsnprintf(path, sizeof(path), "/proc/%d/exe", (int) pid);
+	r = readlink(path, out->name, sizeof(out->name) - 1);
+	if (r <= 0)
+		return false;
+	out->name[r] = '\0';
+
+	xsnprintf(path, sizeof(path), "/proc/%d/auxv", (int) pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	while (read(fd, &auxv, sizeof(auxv)) == sizeof(auxv) && auxv.a_type != AT_NULL)
+	{
+		if (auxv.a_type == AT_PHDR)
+			phdrAddr = auxv.a_un.a_val;
+		else if (auxv.a_type == AT_PHNUM)
+			phnum = auxv.a_un.a_val;
+	}
+	close(fd);
+
+	if (phdrAddr == 0 || phnum == 0)
+		return false;
+
+	std::vector<ElfW(Phdr)> phdrs(phnum);
+	unsigned long relocation = 0;
+
+	if (!ptrace_sys::readMemory(pid, phdrAddr, phdrs.data(), phnum * sizeof(ElfW(Phdr))))
+		return false;
+
+	// PIEs are relocated by where the program headers ended up
+	for (std::vector<ElfW(Phdr)>::const_iterator it = phdrs.begin(); it != phdrs.end(); ++it)
+	{
+		if (it->p_type == PT_PHDR)
+			relocation = phdrAddr - it->p_vaddr;
+	}
+
+	for (std::vector<ElfW(Phdr)>::const_iterator it = phdrs.begin(); it != phdrs.end(); ++it)
+	{
+		if (it->p_type != PT_LOAD)
+			continue;
+
+		if (out->n_segments >= sizeof(out->segments) / sizeof(out->segments[0]))
+			return false;
+
+		struct phdr_data_segment *seg = &out->segments[out->n_segments++];
+
+		seg->paddr = it->p_paddr;
+		seg->vaddr = relocation + it->p_vaddr;
+		seg->size = it->p_memsz;
+	}
+
+	return true;
+}
+
 int ptrace_sys::getEvent(pid_t pid, int status)
 {
 	return (status >> 16);
 }
 
+pid_t ptrace_sys::getEventChild(pid_t pid)
+{
+	unsigned long msg;
+
+	if (ptrace(PTRACE_GETEVENTMSG, pid, 0, &msg) < 0)
+		return -1;
+
+	return msg;
+}
+
 unsigned long ptrace_sys::getPc(int pid)
 {
-	unsigned long regs[1024];
+	return arch_getBreakpointPc(getPcRegister(pid));
+}
+
+static unsigned long getPcRegister(pid_t pid)
+{
+	if (cachedRegsPid == pid)
+		return cachedPc;
+
+#if defined(__i386__) || defined(__x86_64__)
+	errno = 0;
+	unsigned long pc = ptrace(PTRACE_PEEKUSER, pid, (void *) PC_USER_OFFSET, NULL);
+	registerAccesses++;
 
-	memset(regs, 0, sizeof regs);
-	getRegs(pid, NULL, regs, sizeof regs);
-	return getPcFromRegs(regs);
+	// E.g., an exited process
+	if (errno != 0)
+		return 0;
+	cachedPc = pc;
+#else
+	if (getRegs(pid, NULL, cachedRegs, sizeof cachedRegs) < 0)
+		return 0;
+	cachedPc = *arch_pcInRegs(cachedRegs);
+#endif
+	cachedRegsPid = pid;
+
+	return cachedPc;
+}
+
+static void setPcRegister(pid_t pid, unsigned long pc)
+{
+	// Nothing to write back (or the registers could not be read)
+	if (getPcRegister(pid) == pc || cachedRegsPid != pid)
+		return;
+
+#if defined(__i386__) || defined(__x86_64__)
+	ptrace(PTRACE_POKEUSER, pid, (void *) PC_USER_OFFSET, (void *) pc);
+	registerAccesses++;
+#else
+	*arch_pcInRegs(cachedRegs) = pc;
+	setRegs(pid, NULL, cachedRegs, sizeof cachedRegs);
+#endif
+	cachedPc = pc;
 }
 
-static unsigned long getPcFromRegs(unsigned long *regs)
+unsigned long ptrace_sys::getRegisterAccesses(void)
 {
-	return arch_getPcFromRegs(regs);
+	return registerAccesses;
 }
 
+// Only needed where the PC can't be accessed on its own
+#if !defined(__i386__) && !defined(__x86_64__)
 static long getRegs(pid_t pid, void *addr, void *regs, size_t len)
 {
+	registerAccesses++;
+
 #if defined(__aarch64__) || defined(__loongarch__)
 	struct iovec iov =
 	{	regs, len};
@@ -334,6 +559,7 @@ static long getRegs(pid_t pid, void *addr, void *regs, size_t len)
 	return ptrace(PTRACE_GETREGS, pid, NULL, regs);
 #endif
 }
+#endif
 
 static int kill_lwp(unsigned long lwpid, int signo)
 {
@@ -371,8 +597,39 @@ void ptrace_sys::pokeWord(pid_t pid, unsigned long aligned_addr, unsigned long v
 	ptrace(PTRACE_POKETEXT, pid, aligned_addr, value);
 }
 
+/*
+ * /proc/PID/mem is used instead of process_vm_readv/writev since the latter
+ * honors page protections, and text pages are normally read-only. Writes
+ * through /proc/PID/mem are forced, just like PTRACE_POKETEXT.
+ */
+static int openMemory(pid_t pid, int flags)
+{
+	char path[64];
+
+	xsnprintf(path, sizeof(path), "/proc/%d/mem", (int) pid);
+
+	return open(path, flags);
+}
+
+bool ptrace_sys::readMemory(pid_t pid, unsigned long addr, void *buf, size_t len)
+{
+	int fd = openMemory(pid, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+
+	ssize_t r = pread(fd, buf, len, (off_t) addr);
+	close(fd);
+
+	return r == (ssize_t) len;
+}
+
+// Only needed where the PC can't be accessed on its own
+#if !defined(__i386__) && !defined(__x86_64__)
 static long setRegs(pid_t pid, void *addr, void *regs, size_t len)
 {
+	registerAccesses++;
+
 #if defined(__aarch64__) || defined(__loongarch__)
 	struct iovec iov =
 	{	regs, len};
@@ -382,14 +639,12 @@ static long setRegs(pid_t pid, void *addr, void *regs, size_t len)
 	return ptrace(PTRACE_SETREGS, pid, NULL, regs);
 #endif
 }
+#endif
 
 void ptrace_sys::singleStep(pid_t pid)
 {
 	// Step back one instruction
-	unsigned long regs[1024];
-	getRegs(pid, NULL, regs, sizeof regs);
-	arch_adjustPcAfterBreakpoint(regs);
-	setRegs(pid, NULL, regs, sizeof regs);
+	setPcRegister(pid, arch_adjustPcAfterBreakpoint(getPcRegister(pid)));
 }
 
 // Skip over this instruction
@@ -397,25 +652,15 @@ void ptrace_sys::skipInstruction(pid_t pid)
 {
 	// Nop on x86, op on PowerPC/ARM
 #if defined(__powerpc__) || defined(__arm__) || defined(__aarch64__) || defined(__loongarch__)
-	unsigned long regs[1024];
-
-	getRegs(pid, NULL, regs, sizeof regs);
-
-# if defined(__powerpc__)
-	regs[ppc_NIP] += 4;
-# elif defined(__aarch64__)
-	regs[aarch64_PC] += 4;
-# elif defined(__arm__)
-	regs[arm_PC] += 4;
-# elif defined(__loongarch__)
-	regs[loongarch_ERA] += 4;
-# elif defined(__sparc__) && defined(__arch64__)
-	regs[sparc64_TPC] += 4;
-# endif
-	setRegs(pid, NULL, regs, sizeof regs);
+	setPcRegister(pid, getPcRegister(pid) + 4);
 #endif
 }
 
+int ptrace_sys::stop_thread(pid_t tgid, pid_t tid)
+{
+	return syscall(SYS_tgkill, tgid, tid, SIGSTOP);
+}
+
 void ptrace_sys::tie_process_to_cpu(pid_t pid, int cpu)
 {
 	// Switching CPU while running will cause icache
@@ -437,5 +682,40 @@ int ptrace_sys::trace_me(void)
 
 pid_t ptrace_sys::wait_all(int *status)
 {
-	return waitpid(-1, status, __WALL);
+	return waitForStop(-1, status, __WALL);
+}
+
+int ptrace_sys::wait_pid(pid_t pid, int *status)
+{
+	return waitForStop(pid, status, __WALL);
+}
+
+int ptrace_sys::wait_thread(int *status)
+{
+	return waitForStop(-1, status, __WALL | __WNOTHREAD);
+}
+
+/*
+ * All stops are collected here, and a thread can't be accessed between being
+ * continued or detached and its next stop, so this is the only place where the
+ * register cache has to be invalidated.
+ */
+static pid_t waitForStop(pid_t pid, int *status, int options)
+{
+	cachedRegsPid = -1;
+
+	return waitpid(pid, status, options);
+}
+
+bool ptrace_sys::writeMemory(pid_t pid, unsigned long addr, const void *buf, size_t len)
+{
+	int fd = openMemory(pid, O_WRONLY);
+
+	if (fd < 0)
+		return false;
+
+	ssize_t r = pwrite(fd, buf, len, (off_t) addr);
+	close(fd);
+
+	return r == (ssize_t) len;
 }
@@ -1,26 +1,57 @@
+struct phdr_data_entry;
+
 namespace ptrace_sys
 {
 
+// Attach to a single, stopped, process
+int attach(pid_t pid);
+// Attach to all threads of a running process and stop them. Returns the number of threads
 int attachAll (pid_t pid);
 int cont(pid_t pid, int signal);
 void detach(pid_t pid);
+// Detach and leave the process stopped, so that another thread can attach to it
+void detach_stopped(pid_t pid);
 bool disable_aslr(void);
 // Does this event relate to creating new processes or threads?
 bool eventIsForky(int signal, int event);
 // Does this event come from a newly created, traced, child?
 bool eventIsNewChild(int signal, int event);
+// Is this a job control stop (SIGSTOP, SIGTSTP, ...) of a seized process?
+bool eventIsGroupStop(int signal, int event);
+// Has the process just replaced its image with execve()?
+bool eventIsExec(int signal, int event);
 int follow_child(pid_t pid);
 int follow_fork(pid_t pid);
 int get_current_cpu(void);
+// Can processes be traced from different threads in kcov?
+bool has_tracer_threads(void);
+// Leave a process in a group stop stopped, but get its later events (e.g., SIGCONT)
+int listen(pid_t pid);
+// Get the thread group (i.e., process) of a thread
+pid_t get_tgid(pid_t pid);
+// Get the path and loaded segments of the executable of a process stopped after exec
+bool get_exec_image(pid_t pid, struct phdr_data_entry *out);
 // Get the event that caused a trap.  The event is opaque to the caller.
 int getEvent(pid_t pid, int status);
+// Get the new process or thread of a fork/clone event
+pid_t getEventChild(pid_t pid);
 unsigned long getPc(int pid);
+// Number of register reads/writes done so far, for statistics
+unsigned long getRegisterAccesses(void);
 unsigned long peekWord(pid_t pid, unsigned long aligned_addr);
 void pokeWord(pid_t pid, unsigned long aligned_addr, unsigned long value);
+// Bulk access to tracee memory. Returns false if the whole block could not be transferred
+bool readMemory(pid_t pid, unsigned long addr, void *buf, size_t len);
+bool writeMemory(pid_t pid, unsigned long addr, const void *buf, size_t len);
 void singleStep(pid_t pid);
 void skipInstruction(pid_t pid);
+// Send SIGSTOP to a single thread
+int stop_thread(pid_t tgid, pid_t tid);
 void tie_process_to_cpu(pid_t pid, int cpu);
 int trace_me(void);
 int wait_all(int *status);
+int wait_pid(pid_t pid, int *status);
+// Wait for the tracees of the calling thread only
+int wait_thread(int *status);
 
 }
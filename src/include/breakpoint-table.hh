@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+namespace kcov
+{
+	/**
+	 * Address -> original instruction word map for breakpoints.
+	 *
+	 * Open addressing with linear probing, with the key and value next to each
+	 * other, so a lookup is typically a single cache miss. Address 0 marks
+	 * empty slots (and is never a valid breakpoint). Entries can't be removed,
+	 * since breakpoints are kept after they have been hit.
+	 */
+	class BreakpointTable
+	{
+	public:
+		BreakpointTable() :
+			m_size(0), m_mask(0), m_shift(64)
+		{
+		}
+
+		/**
+		 * Lookup the value for an address
+		 *
+		 * @param addr the address
+		 *
+		 * @return a pointer to the value, or NULL if @a addr isn't in the table
+		 */
+		unsigned long *lookup(unsigned long addr)
+		{
+			if (m_size == 0)
+				return NULL;
+
+			for (size_t i = slot(addr);; i = (i + 1) & m_mask)
+			{
+				Entry &cur = m_entries[i];
+
+				if (cur.addr == addr)
+					return &cur.value;
+				if (cur.addr == 0)
+					return NULL;
+			}
+		}
+
+		const unsigned long *lookup(unsigned long addr) const
+		{
+			return const_cast<BreakpointTable *>(this)->lookup(addr);
+		}
+
+		bool contains(unsigned long addr) const
+		{
+			return lookup(addr) != NULL;
+		}
+
+		/**
+		 * Get the value for an address, inserting it with value 0 if it's not
+		 * in the table
+		 */
+		unsigned long &operator[](unsigned long addr)
+		{
+			reserve(m_size + 1);
+
+			for (size_t i = slot(addr);; i = (i + 1) & m_mask)
+			{
+				Entry &cur = m_entries[i];
+
+				if (cur.addr == addr)
+					return cur.value;
+
+				if (cur.addr == 0)
+				{
+					cur.addr = addr;
+					m_size++;
+
+					return cur.value;
+				}
+			}
+		}
+
+		/**
+		 * Make room for @a count entries, so that they can be inserted without
+		 * the table being rebuilt in between. Used before inserting many at once.
+		 */
+		void reserve(size_t count)
+		{
+			// At most 3/4 full
+			if (count * 4 <= m_entries.size() * 3)
+				return;
+
+			size_t capacity = m_entries.empty() ? 64 : m_entries.size();
+			unsigned int shift = m_entries.empty() ? 58 : m_shift;
+
+			while (count * 4 > capacity * 3)
+			{
+				capacity *= 2;
+				shift--;
+			}
+
+			std::vector<Entry> old(capacity);
+
+			old.swap(m_entries);
+			m_mask = capacity - 1;
+			m_shift = shift;
+			m_size = 0;
+
+			for (std::vector<Entry>::const_iterator it = old.begin(); it != old.end(); ++it)
+			{
+				if (it->addr != 0)
+					(*this)[it->addr] = it->value;
+			}
+		}
+
+		/**
+		 * @return all addresses in the table, in no particular order
+		 */
+		std::vector<unsigned long> addresses() const
+		{
+			std::vector<unsigned long> out;
+
+			out.reserve(m_size);
+			for (std::vector<Entry>::const_iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+			{
+				if (it->addr != 0)
+					out.push_back(it->addr);
+			}
+
+			return out;
+		}
+
+		size_t size() const
+		{
+			return m_size;
+		}
+
+		bool empty() const
+		{
+			return m_size == 0;
+		}
+
+		/**
+		 * @return the number of bytes used by the entries
+		 */
+		size_t memoryUsage() const
+		{
+			return m_entries.size() * sizeof(Entry);
+		}
+
+	private:
+		struct Entry
+		{
+			Entry() : addr(0), value(0)
+			{
+			}
+
+			unsigned long addr;
+			unsigned long value;
+		};
+
+		// Fibonacci hashing, since breakpoint addresses are close to each other
+		size_t slot(unsigned long addr) const
+		{
+			return (size_t) (((uint64_t) addr * 0x9e3779b97f4a7c15ULL) >> m_shift) & m_mask;
+		}
+
+		std::vector<Entry> m_entries;
+		size_t m_size;
+		size_t m_mask;
+		unsigned int m_shift;
+	};
+}
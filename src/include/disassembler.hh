@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include <memory>
 #include <vector>
 
 namespace kcov
@@ -22,11 +23,21 @@ namespace kcov
 		/**
 		 * Add an executable section
 		 *
-		 * @param sectionData the data of the section
+		 * @param sectionData the data of the section, which is referred to, not copied
 		 * @param sectionSize the size of the section
 		 * @param base address the virtual start address
 		 */
-		virtual void addSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress) = 0;
+		virtual void addSection(const std::shared_ptr<const void> &sectionData, size_t sectionSize,
+				uint64_t baseAddress) = 0;
+
+		/**
+		 * Add a function in one of the sections. verify() then disassembles
+		 * the function of an address instead of the whole section.
+		 *
+		 * @param start the address of the first instruction
+		 * @param end the address after the function
+		 */
+		virtual void addFunction(uint64_t start, uint64_t end) = 0;
 
 		/**
 		 * Check if an address is a valid breakpoint "point".
@@ -2,6 +2,7 @@
 
 #include <utils.hh>
 
+#include <memory>
 #include <vector>
 #include <utility>
 #include <string>
@@ -19,33 +20,16 @@ namespace kcov
 
 	/**
 	 * Holder class for address segments
+	 *
+	 * The data isn't copied, but points into the mapped file, which stays
+	 * mapped as long as something refers to it.
 	 */
 	class Segment
 	{
 	public:
-		Segment(const void *data, uint64_t paddr, uint64_t vaddr, uint64_t size) :
-			m_data(NULL), m_paddr(paddr), m_vaddr(vaddr), m_size(size)
+		Segment(const std::shared_ptr<const void> &data, uint64_t paddr, uint64_t vaddr, uint64_t size) :
+			m_data(data), m_paddr(paddr), m_vaddr(vaddr), m_size(size)
 		{
-			if (data)
-			{
-				m_data = xmalloc(size);
-				memcpy(m_data, data, size);
-			}
-		}
-
-		Segment(const Segment &other) :
-			m_data(NULL), m_paddr(other.m_paddr), m_vaddr(other.m_vaddr), m_size(other.m_size)
-		{
-			if (other.m_data)
-			{
-				m_data = xmalloc(other.m_size);
-				memcpy(m_data, other.m_data, other.m_size);
-			}
-		}
-
-		~Segment()
-		{
-			free(m_data);
 		}
 
 		/**
@@ -80,7 +64,23 @@ namespace kcov
 			return m_vaddr;
 		}
 
+		/**
+		 * Get the first address in the segment, as checked by addressIsWithinSegment()
+		 */
+		uint64_t getStart() const
+		{
+			return m_paddr;
+		}
+
 		const void *getData() const
+		{
+			return m_data.get();
+		}
+
+		/**
+		 * Get the data, together with the reference to the file it's in
+		 */
+		const std::shared_ptr<const void> &getSharedData() const
 		{
 			return m_data;
 		}
@@ -91,7 +91,7 @@ namespace kcov
 		}
 
 	private:
-		void *m_data;
+		std::shared_ptr<const void> m_data;
 
 		// Should really be const, but GCC 4.6 doesn't like that
 		uint64_t m_paddr;
@@ -61,6 +61,34 @@ namespace kcov
 		 */
 		virtual int registerBreakpoint(unsigned long addr) = 0;
 
+		/**
+		 * Set a breakpoint which is only armed when a function has been entered
+		 *
+		 * Engines which can't arm breakpoints lazily set it directly.
+		 *
+		 * @param entry the address of the function entry
+		 * @param addr the address to set the breakpoint on
+		 *
+		 * @return the ID of the breakpoint, or -1 on failure
+		 */
+		virtual int registerLazyBreakpoint(unsigned long entry, unsigned long addr)
+		{
+			return registerBreakpoint(addr);
+		}
+
+		/**
+		 * Add a basic block of straight-line code
+		 *
+		 * Engines can use this to report all breakpoints after a hit one
+		 * in the block without taking a trap for each.
+		 *
+		 * @param first the address of the first instruction in the block
+		 * @param last the address of the last instruction in the block
+		 */
+		virtual void registerBasicBlock(unsigned long first, unsigned long last)
+		{
+		}
+
 		/**
 		 * Fork a new process and attach to it
 		 *
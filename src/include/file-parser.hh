@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <utils.hh>
@@ -59,8 +60,47 @@ namespace kcov
 		class ILineListener
 		{
 		public:
+			typedef std::vector<std::pair<unsigned int, uint64_t> > LineAddrList_t;
+
 			virtual void onLine(const std::string &file, unsigned int lineNr,
 					uint64_t addr) = 0;
+
+			/**
+			 * Report several lines of the same file at once
+			 *
+			 * Parsers use this when they have the lines of a file together, so
+			 * that listeners which look up or filter the file can do that once.
+			 *
+			 * @param file the source file
+			 * @param lines line number and address pairs
+			 */
+			virtual void onLines(const std::string &file, const LineAddrList_t &lines)
+			{
+				for (LineAddrList_t::const_iterator it = lines.begin(); it != lines.end(); ++it)
+					onLine(file, it->first, it->second);
+			}
+		};
+
+		/**
+		 * Listener for functions (the address range of the code in them)
+		 */
+		class IFunctionListener
+		{
+		public:
+			virtual void onFunction(uint64_t start, uint64_t end) = 0;
+		};
+
+		/**
+		 * Listener for basic blocks (straight-line code)
+		 */
+		class IBasicBlockListener
+		{
+		public:
+			/**
+			 * @param first the address of the first instruction in the block
+			 * @param last the address of the last instruction in the block
+			 */
+			virtual void onBasicBlock(uint64_t first, uint64_t last) = 0;
 		};
 
 		/**
@@ -116,6 +156,30 @@ namespace kcov
 		 */
 		virtual void registerFileListener(IFileListener &listener) = 0;
 
+		/**
+		 * Register a listener for functions.
+		 *
+		 * The functions of a file are reported before the lines in it. Parsers
+		 * which don't know about functions never call the listener.
+		 *
+		 * @param listener the listener
+		 */
+		virtual void registerFunctionListener(IFunctionListener &listener)
+		{
+		}
+
+		/**
+		 * Register a listener for basic blocks.
+		 *
+		 * The block of a line is reported before the line. Parsers which can't
+		 * disassemble the code never call the listener.
+		 *
+		 * @param listener the listener
+		 */
+		virtual void registerBasicBlockListener(IBasicBlockListener &listener)
+		{
+		}
+
 		/**
 		 * Parse the added files
 		 *
@@ -123,6 +187,19 @@ namespace kcov
 		 */
 		virtual bool parse() = 0;
 
+		/**
+		 * Read a file and its debug information ahead of addFile() and parse()
+		 *
+		 * Unlike the other methods, this can be called from any thread. The
+		 * listeners are not called, but a later parse() of the file only has to
+		 * report what was found. Parsers without anything to prepare ignore this.
+		 *
+		 * @param filename the filename to prepare
+		 */
+		virtual void preparseFile(const std::string &filename)
+		{
+		}
+
 		/**
 		 * Get the checksum of the main file (not solibs)
 		 *
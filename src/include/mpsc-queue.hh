@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+
+namespace kcov
+{
+	/**
+	 * Lock-free multiple producer, single consumer queue (Dmitry Vyukov's
+	 * intrusive MPSC node queue). push() can be called from any thread,
+	 * pop() only from one.
+	 */
+	template<typename T>
+	class MpscQueue
+	{
+	public:
+		MpscQueue() :
+			m_head(&m_stub), m_tail(&m_stub)
+		{
+			m_stub.next.store(NULL, std::memory_order_relaxed);
+		}
+
+		~MpscQueue()
+		{
+			T item;
+
+			while (pop(item))
+				;
+		}
+
+		void push(const T &item)
+		{
+			Node *node = new Node(item);
+
+			pushNode(node);
+		}
+
+		/**
+		 * Get the oldest item
+		 *
+		 * @param out where to store the item
+		 *
+		 * @return true if an item was returned, false if the queue is empty (or if
+		 *         a producer is in the middle of a push)
+		 */
+		bool pop(T &out)
+		{
+			Node *tail = m_tail;
+			Node *next = tail->next.load(std::memory_order_acquire);
+
+			if (tail == &m_stub)
+			{
+				if (!next)
+					return false;
+
+				m_tail = next;
+				tail = next;
+				next = next->next.load(std::memory_order_acquire);
+			}
+
+			if (!next)
+			{
+				// A producer has swapped the head, but not yet linked the node
+				if (tail != m_head.load(std::memory_order_acquire))
+					return false;
+
+				pushNode(&m_stub);
+				next = tail->next.load(std::memory_order_acquire);
+				if (!next)
+					return false;
+			}
+
+			out = tail->item;
+			m_tail = next;
+			delete tail;
+
+			return true;
+		}
+
+	private:
+		class Node
+		{
+		public:
+			Node() : item()
+			{
+			}
+
+			Node(const T &item) : item(item)
+			{
+				next.store(NULL, std::memory_order_relaxed);
+			}
+
+			std::atomic<Node *> next;
+			T item;
+		};
+
+		void pushNode(Node *node)
+		{
+			node->next.store(NULL, std::memory_order_relaxed);
+
+			Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+			prev->next.store(node, std::memory_order_release);
+		}
+
+		Node m_stub;
+		std::atomic<Node *> m_head;
+		Node *m_tail;
+	};
+}
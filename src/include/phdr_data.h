@@ -27,8 +27,11 @@ struct phdr_data
 {
 	uint32_t magic;
 	uint32_t version;
+	uint32_t pid;
+	uint32_t seq; // Message number in the process, followed by one trap
+	uint32_t generation; // Objects loaded in the process so far
 	unsigned long relocation; // for PIE
-	uint32_t n_entries;
+	uint32_t n_entries; // Loaded since the last message
 
 	struct phdr_data_entry entries[];
 };
@@ -3,6 +3,12 @@
 #include <engine.hh>
 #include <collector.hh>
 
+#include <string>
+
+#include <sys/types.h>
+
+struct phdr_data_entry;
+
 namespace kcov
 {
 	class ISolibHandler
@@ -13,10 +19,45 @@ namespace kcov
 		}
 
 		virtual void startup() = 0;
+
+		// Report the solibs which are still being parsed, after the program has exited
+		virtual void finish() = 0;
 	};
 
 	ISolibHandler &createSolibHandler(IFileParser &parser, ICollector &collector);
 
-	// Wait for the solib thread to finish parsing the solib data
-	void blockUntilSolibDataRead();
+	/**
+	 * Wait for the solib data which a process sends before a trap
+	 *
+	 * @param pid the process (thread group)
+	 * @param count the number of traps taken in the process
+	 *
+	 * @return the number of messages received from @a pid
+	 */
+	unsigned int waitForSolibData(pid_t pid, unsigned int count);
+
+	/**
+	 * Check if a trap was taken by the solib wrapper after sending its data
+	 *
+	 * Traps which the program raises itself (int3, raise(SIGTRAP)) have no
+	 * solib data to wait for.
+	 *
+	 * @param pid the process (thread group)
+	 * @param addr the address of the trap
+	 *
+	 * @return true if @a addr is in the wrapper
+	 */
+	bool isSolibTrap(pid_t pid, uint64_t addr);
+
+	// Restart the message count, when the process has exec'd or exited
+	void forgetSolibData(pid_t pid);
+
+	// Has solib data been read, but not yet parsed?
+	bool solibDataPending();
+
+	// Identify an exec'd executable by build-id and load address, or "" if it can't be read
+	std::string execImageId(const struct phdr_data_entry *image);
+
+	// Parse an executable which a traced process has exec'd, like a solib
+	void parseExecImage(struct phdr_data_entry *image);
 }
@@ -96,6 +96,18 @@ extern int write_file(const void *data, size_t len, const char *fmt, ...) __attr
 
 extern void *read_file(size_t *out_size, const char *fmt, ...) __attribute__((format(printf,2,3)));
 
+/**
+ * Map a file into memory, without copying it
+ *
+ * The mapping is private, so changes to the data are not written back. Files
+ * which can't be mapped, like FIFOs, are read as with read_file().
+ *
+ * @return the data, to be released with unmap_file(), or NULL on errors
+ */
+extern void *map_file(size_t *out_size, const char *fmt, ...) __attribute__((format(printf,2,3)));
+
+extern void unmap_file(void *data, size_t size);
+
 extern void *peek_file(size_t *out_size, const char *fmt, ...) __attribute__((format(printf,2,3)));
 
 extern std::string dir_concat(const std::string &dir, const std::string &filename);
@@ -151,6 +163,8 @@ void mdelay(unsigned int ms);
 
 uint64_t get_ms_timestamp(void);
 
+uint64_t get_us_timestamp(void);
+
 bool machine_is_64bit(void);
 
 std::vector<std::string> split_string(const std::string &s, const char *delims);
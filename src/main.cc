@@ -340,6 +340,7 @@ static int runKcov(IConfiguration::RunMode_t runningMode)
 	if (runningMode != IConfiguration::MODE_REPORT_ONLY)
 	{
 		ret = collector.run(file);
+		solibHandler.finish();
 	}
 	else
 	{
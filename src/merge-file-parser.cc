@@ -362,7 +362,7 @@ private:
 		if (!string_is_integer(curFile, 16))
 			return;
 
-		struct file_data *fd = (struct file_data *)read_file(&size, "%s/%s", metadataDirName.c_str(), curFile.c_str());
+		struct file_data *fd = (struct file_data *)map_file(&size, "%s/%s", metadataDirName.c_str(), curFile.c_str());
 		if (!fd)
 			return;
 
@@ -371,7 +371,7 @@ private:
 			parseFileData(fd);
 		}
 
-		free(fd);
+		unmap_file(fd, size);
 	}
 
 	void parseFileData(struct file_data *fd)
@@ -553,12 +553,12 @@ private:
 			void *data;
 			size_t size;
 
-			data = read_file(&size, "%s", filename.c_str());
+			data = map_file(&size, "%s", filename.c_str());
 			panic_if(!data, "File %s exists, but can't be read???", filename.c_str());
 			m_checksum = hash_block(data, size);
 			m_fileTimestamp = get_file_timestamp(filename.c_str());
 
-			free((void *) data);
+			unmap_file(data, size);
 		}
 
 		void setLocal()
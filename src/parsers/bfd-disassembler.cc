@@ -1,6 +1,7 @@
 #include <disassembler.hh>
 #include <utils.hh>
 
+#include <memory>
 #include <unordered_map>
 #include <set>
 #include <map>
@@ -53,12 +54,54 @@ const std::set<std::string> x86BranchInstructions =
 		"jz",
 		"jczx",
 		"jezx",
+		"jcxz",
+		"jecxz",
+		"jrcxz",
 		"loop",
+		"loope",
+		"loopne",
 		"jmp",
+		"jmpq",
 		"call",
+		"callq",
 		"ret",
 };
 
+// Execution doesn't continue after these
+const std::set<std::string> x86ExitInstructions =
+{
+		"ret",
+		"retq",
+		"retl",
+		"hlt",
+		"ud2",
+};
+
+// Calls and others which might not return
+const std::set<std::string> x86CallInstructions =
+{
+		"call",
+		"callq",
+		"calll",
+		"syscall",
+};
+
+// Printed before the mnemonic (repz ret, notrack jmp, ...)
+const std::set<std::string> x86PrefixInstructions =
+{
+		"bnd",
+		"notrack",
+		"lock",
+		"rep",
+		"repz",
+		"repnz",
+		"repe",
+		"repne",
+		"data16",
+		"cs",
+		"ds",
+};
+
 /*
  * Since binutils >= 2.29 or so, print_insn_i386 is no longer defined in
  * dis-asm.h. I'm not sure what the correct and backwards compatible way
@@ -83,6 +126,17 @@ public:
 
 		disassemble_init_for_target(&m_info);
 		m_info.application_data = (void *)this;
+
+		// For verify(), which only needs the instruction sizes
+		memset(&m_sizeInfo, 0, sizeof(m_sizeInfo));
+#if KCOV_LIBFD_DISASM_STYLED
+		init_disassemble_info(&m_sizeInfo, NULL, BfdDisassembler::nullFprintfFuncStatic, BfdDisassembler::nullFprintfStyledFuncStatic);
+#else
+		init_disassemble_info(&m_sizeInfo, NULL, BfdDisassembler::nullFprintfFuncStatic);
+#endif
+		m_sizeInfo.arch = bfd_arch_i386;
+
+		disassemble_init_for_target(&m_sizeInfo);
 	}
 
 	virtual void setup(const void *header, size_t headerSize)
@@ -102,15 +156,24 @@ public:
 			m_info.mach = bfd_mach_x86_64;
 		else
 			m_info.mach = bfd_mach_i386_i386;
+		m_sizeInfo.mach = m_info.mach;
 	}
 
-	void addSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress)
+	void addSection(const std::shared_ptr<const void> &sectionData, size_t sectionSize, uint64_t baseAddress)
 	{
 		SectionCache_t::iterator it = m_cache.find(baseAddress);
 
 		// Not visited before
 		if (it == m_cache.end())
-			m_cache[baseAddress] = new Section(sectionData, sectionSize, baseAddress);
+			m_cache[baseAddress].reset(new Section(sectionData, sectionSize, baseAddress));
+	}
+
+	void addFunction(uint64_t start, uint64_t end)
+	{
+		Section *p = lookupSection(start);
+
+		if (p)
+			p->addFunction(start, end);
 	}
 
 	bool verify(uint64_t address)
@@ -120,11 +183,8 @@ public:
 		if (!p)
 			return true;
 
-		if (!p->isDisassembled())
-			p->disassemble(*this, m_info, m_disassembler);
-
 		// The address is valid there is an instruction starting at it
-		return getInstruction(address) != NULL;
+		return p->isInstructionStart(address, m_sizeInfo, m_disassembler);
 	}
 
 	const std::vector<uint64_t> &getBasicBlock(uint64_t address)
@@ -132,13 +192,25 @@ public:
 		if (m_bbs.empty())
 			setupBasicBlocks();
 
-		if (m_instructions.find(address) == m_instructions.end())
+		InstructionAddressMap_t::const_iterator it = m_instructions.find(address);
+
+		// Unknown, or a branch target outside the disassembled code
+		if (it == m_instructions.end() || !it->second.getBasicBlock())
 			return m_empty;
 
-		return m_instructions[address].getBasicBlock()->getInstructionAddresses();
+		return it->second.getBasicBlock()->getInstructionAddresses();
 	}
 
 private:
+	enum InstructionType
+	{
+		INSN_NORMAL,
+		INSN_JUMP,        //< Unconditional jump with a known target
+		INSN_CONDITIONAL, //< Conditional branch with a known target
+		INSN_CALL,        //< Continues with the next instruction, if it returns
+		INSN_EXIT,        //< Returns, indirect jumps etc
+	};
+
 	class BasicBlock
 	{
 	public:
@@ -163,8 +235,9 @@ private:
 	class Instruction
 	{
 	public:
-		Instruction(uint64_t branchTarget = 0) :
+		Instruction(uint64_t branchTarget = BT_INVALID, enum InstructionType type = INSN_NORMAL) :
 			m_branchTarget(branchTarget),
+			m_type(type),
 			m_leader(false),
 			m_bb(NULL)
 		{
@@ -180,6 +253,11 @@ private:
 			return m_branchTarget != BT_INVALID;
 		}
 
+		bool endsBasicBlock() const
+		{
+			return m_type != INSN_NORMAL;
+		}
+
 		bool isLeader() const
 		{
 			return m_leader;
@@ -202,6 +280,7 @@ private:
 
 	private:
 		uint64_t m_branchTarget;
+		enum InstructionType m_type;
 		bool m_leader;
 		const BasicBlock *m_bb;
 	};
@@ -209,13 +288,44 @@ private:
 	class Section
 	{
 	public:
-		Section(const void *data, size_t size, uint64_t startAddress) :
+		Section(const std::shared_ptr<const void> &data, size_t size, uint64_t startAddress) :
+			m_data(data),
 			m_size(size),
 			m_startAddress(startAddress),
-			m_disassembled(false)
+			m_disassembled(false),
+			m_instructionStarts(size, false),
+			m_sizesDecoded(false)
+		{
+		}
+
+		void addFunction(uint64_t start, uint64_t end)
 		{
-			m_data = xmalloc(size);
-			memcpy(m_data, data, size);
+			m_functions[start] = Function(end);
+		}
+
+		/*
+		 * Decode the instruction sizes of the function @a address is in, or of
+		 * the whole section if it's not in any, the first time it's needed.
+		 */
+		bool isInstructionStart(uint64_t address, struct disassemble_info &info, disassembler_ftype disassembler)
+		{
+			FunctionMap_t::iterator it = m_functions.upper_bound(address);
+
+			if (it != m_functions.begin() && address < (--it)->second.m_end)
+			{
+				if (!it->second.m_decoded)
+				{
+					it->second.m_decoded = true;
+					decodeSizes(it->first, it->second.m_end, info, disassembler);
+				}
+			}
+			else if (!m_sizesDecoded)
+			{
+				m_sizesDecoded = true;
+				decodeSizes(m_startAddress, m_startAddress + m_size, info, disassembler);
+			}
+
+			return m_instructionStarts[address - m_startAddress];
 		}
 
 		uint64_t getBase() const
@@ -240,9 +350,10 @@ private:
 
 			m_disassembled = true;
 
-			info.buffer_vma = 0;
+			// Branch targets are then printed as absolute addresses
+			info.buffer_vma = m_startAddress;
 			info.buffer_length = m_size;
-			info.buffer = (bfd_byte *)m_data;
+			info.buffer = (bfd_byte *)m_data.get();
 			info.stream = (void *)&target;
 
 			uint64_t pc = 0;
@@ -250,12 +361,12 @@ private:
 			do
 			{
 				target.m_instructionVector.clear();
-				count = disassembler(pc, &info);
+				count = disassembler(pc + m_startAddress, &info);
 
 				if (count < 0)
 					break;
 
-				target.m_instructions[pc + m_startAddress] = target.instructionFactory(pc, target.m_instructionVector);
+				target.m_instructions[pc + m_startAddress] = target.instructionFactory(target.m_instructionVector);
 				// Point back into the other map
 				target.m_orderedInstructions[pc + m_startAddress] = &target.m_instructions[pc + m_startAddress];
 
@@ -264,38 +375,89 @@ private:
 		}
 
 	private:
-		void *m_data;
+		class Function
+		{
+		public:
+			Function(uint64_t end = 0) :
+				m_end(end),
+				m_decoded(false)
+			{
+			}
+
+			uint64_t m_end;
+			bool m_decoded;
+		};
+
+		typedef std::map<uint64_t, Function> FunctionMap_t;
+
+		void decodeSizes(uint64_t start, uint64_t end, struct disassemble_info &info, disassembler_ftype disassembler)
+		{
+			info.buffer_vma = m_startAddress;
+			info.buffer_length = m_size;
+			info.buffer = (bfd_byte *)m_data.get();
+
+			if (end > m_startAddress + m_size)
+				end = m_startAddress + m_size;
+
+			uint64_t pc = start;
+			while (pc < end)
+			{
+				m_instructionStarts[pc - m_startAddress] = true;
+
+				int count = disassembler(pc, &info);
+				if (count <= 0)
+					break;
+
+				pc += count;
+			}
+		}
+
+		const std::shared_ptr<const void> m_data;
 		const size_t m_size;
 		const uint64_t m_startAddress;
 
 		bool m_disassembled; // Lazy disassembly once it's used
+
+		// For verify(), one bit per byte
+		std::vector<bool> m_instructionStarts;
+		FunctionMap_t m_functions;
+		bool m_sizesDecoded;
 	};
 
 	// Implementation taken from EmilPRO, https://github.com/SimonKagstrom/emilpro
-	Instruction instructionFactory(uint64_t pc, const std::vector<std::string> &vec)
+	Instruction instructionFactory(const std::vector<std::string> &vec)
 	{
 		uint64_t branchTarget = BT_INVALID; // Invalid
+		unsigned int mnemonic = 0;
 
 		// No encoding???
 		if (vec.size() < 1)
 			return Instruction();
 
-		std::set<std::string>::const_iterator it = x86BranchInstructions.find(vec[0]);
+		if (vec.size() >= 2 && x86PrefixInstructions.find(vec[0]) != x86PrefixInstructions.end())
+			mnemonic = 1;
+
+		const std::string &name = vec[mnemonic];
+
+		if (x86ExitInstructions.find(name) != x86ExitInstructions.end())
+			return Instruction(BT_INVALID, INSN_EXIT);
+
+		if (x86CallInstructions.find(name) != x86CallInstructions.end())
+			return Instruction(BT_INVALID, INSN_CALL);
+
+		if (x86BranchInstructions.find(name) == x86BranchInstructions.end())
+			return Instruction();
 
 		// Address?
-		if (it != x86BranchInstructions.end() &&
-				vec.size() >= 2 && string_is_integer(vec[1]))
-		{
-			int64_t offset = string_to_integer(vec[1]);
+		if (vec.size() < mnemonic + 2 || !string_is_integer(vec[mnemonic + 1]))
+			return Instruction(BT_INVALID, INSN_EXIT);
 
-			// FIXME! Check if this is correct
-			if ( (offset & (1 << 31)) )
-				offset |= 0xffffffff00000000ULL;
+		branchTarget = string_to_integer(vec[mnemonic + 1]);
 
-			branchTarget = pc + offset;
-		}
+		if (name == "jmp" || name == "jmpq")
+			return Instruction(branchTarget, INSN_JUMP);
 
-		return Instruction(branchTarget);
+		return Instruction(branchTarget, INSN_CONDITIONAL);
 	}
 
 	Section *lookupSection(uint64_t address)
@@ -307,7 +469,7 @@ private:
 		// Rare case, the searched for address might be exactly the base address of
 		// this section
 		if (it != m_cache.end() && it->first == address) {
-			return it->second;
+			return it->second.get();
 		}
 
 		// Go back one section (this might be too far, but we'll check later)
@@ -320,7 +482,7 @@ private:
 
 		// We've found the highest-starting section that's lower than the target
 		// address, check it actually contains the address
-		Section *cur = it->second;
+		Section *cur = it->second.get();
 		uint64_t end = cur->getBase() + cur->getSize() - 1;
 
 		// Address is below the section's baseAddress (impossible from the above
@@ -365,15 +527,20 @@ private:
 			// Mark branch targets as leaders, as well as the instruction after that
 			if (cur->second->isBranch())
 			{
-				m_instructions[cur->second->getBranchTarget()].makeLeader();
-				next->second->makeLeader();
+				Instruction *target = getInstruction(cur->second->getBranchTarget());
+
+				if (target)
+					target->makeLeader();
 			}
+
+			if (cur->second->endsBasicBlock())
+				next->second->makeLeader();
 		}
 
 		// Create and populate basic blocks
 		BasicBlock *bb = NULL;
 
-		m_bbs.push_back(bb);
+		m_bbs.push_back(std::unique_ptr<BasicBlock>());
 		for (InstructionOrderedMap_t::iterator it = m_orderedInstructions.begin();
 				it != m_orderedInstructions.end();
 				++it)
@@ -383,7 +550,7 @@ private:
 			if (cur->isLeader())
 			{
 				bb = new BasicBlock();
-				m_bbs.push_back(bb);
+				m_bbs.push_back(std::unique_ptr<BasicBlock>(bb));
 			}
 
 			cur->setBasicBlock(bb);
@@ -406,6 +573,18 @@ private:
 		m_instructionVector.push_back(trim_string(stdStr));
 	}
 
+	static int nullFprintfFuncStatic(void *info, const char *fmt, ...)
+	{
+		return 0;
+	}
+
+#if KCOV_LIBFD_DISASM_STYLED
+	static int nullFprintfStyledFuncStatic(void *info, enum disassembler_style style, const char *fmt, ...)
+	{
+		return 0;
+	}
+#endif
+
 	static int opcodesFprintFuncStatic(void *info, const char *fmt, ...)
 	{
 		BfdDisassembler *pThis = (BfdDisassembler *)info;
@@ -441,11 +620,13 @@ private:
 	}
 #endif
 
-	typedef std::map<uint64_t, Section *> SectionCache_t;
+	// Owned, so that the mapped files are released with the sections
+	typedef std::map<uint64_t, std::unique_ptr<Section>> SectionCache_t;
 	typedef std::unordered_map<uint64_t, Instruction> InstructionAddressMap_t;
 	typedef std::map<uint64_t, Instruction *> InstructionOrderedMap_t;
 
 	struct disassemble_info m_info;
+	struct disassemble_info m_sizeInfo;
 	disassembler_ftype m_disassembler;
 
 	std::vector<std::string> m_instructionVector;
@@ -454,7 +635,7 @@ private:
 	InstructionAddressMap_t m_instructions;
 	InstructionOrderedMap_t m_orderedInstructions;
 
-	std::vector<BasicBlock *> m_bbs;
+	std::vector<std::unique_ptr<BasicBlock>> m_bbs;
 	std::vector<uint64_t> m_empty;
 };
 
@@ -9,7 +9,11 @@ public:
 	{
 	}
 
-	void addSection(const void *sectionData, size_t sectionSize, uint64_t baseAddress)
+	void addSection(const std::shared_ptr<const void> &sectionData, size_t sectionSize, uint64_t baseAddress)
+	{
+	}
+
+	void addFunction(uint64_t start, uint64_t end)
 	{
 	}
 
@@ -44,7 +44,7 @@ DwarfParser::~DwarfParser()
 	delete m_impl;
 }
 
-void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
+void DwarfParser::forEachLine(IFileParser::ILineListener& listener, IFileFilter *filter)
 {
 	Dwarf_Unsigned header;
 
@@ -98,6 +98,10 @@ void DwarfParser::forAddress(IFileParser::ILineListener& listener, uint64_t addr
 	panic("NYI");
 }
 
+void DwarfParser::startLineWorkers(unsigned int nThreads)
+{
+}
+
 
 std::string DwarfParser::fullPath(const char *const *srcDirs, const std::string &filename)
 {
@@ -3,50 +3,66 @@
 #include <utils.hh>
 
 #include <elfutils/libdw.h>
+#include <elfutils/version.h>
+#include <dwarf.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 using namespace kcov;
 
 class DwarfParser::Impl
 {
 public:
+	// The lines of one compilation unit, grouped by file, or its functions
+	class Unit
+	{
+	public:
+		std::vector<std::string> m_files;
+		std::vector<IFileParser::ILineListener::LineAddrList_t> m_lines;
+		std::vector<std::pair<uint64_t, uint64_t> > m_functions;
+	};
+
 	Impl() :
 	m_fd(-1),
 	m_dwarf(NULL)
 	{
 	}
 
-	int m_fd;
-	Dwarf *m_dwarf;
-};
-
-DwarfParser::DwarfParser()
-{
-	m_impl = new DwarfParser::Impl();
-}
+	// The DIE offsets of the compilation units
+	std::vector<Dwarf_Off> getUnits()
+	{
+		std::vector<Dwarf_Off> out;
+		Dwarf_Off offset = 0;
+		Dwarf_Off lastOffset = 0;
+		size_t headerSize;
 
-DwarfParser::~DwarfParser()
-{
-	close();
-	delete m_impl;
-}
+		while (dwarf_nextcu(m_dwarf, offset, &offset, &headerSize, 0, 0, 0) == 0)
+		{
+			out.push_back(lastOffset + headerSize);
+			lastOffset = offset;
+		}
 
-void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
-{
-	if (!m_impl->m_dwarf)
-		return;
+		return out;
+	}
 
-	Dwarf_Off offset = 0;
-	Dwarf_Off lastOffset = 0;
-	size_t headerSize;
+	enum
+	{
+		FILE_EXCLUDED = 0xffffffff,
+	};
 
-	/* Iterate over the headers */
-	while (dwarf_nextcu(m_impl->m_dwarf, offset, &offset, &headerSize, 0, 0, 0) == 0)
+	// Thread-safe as long as each thread has its own @a dwarf
+	static void decodeUnit(Dwarf *dwarf, Dwarf_Off dieOffset, Unit &out, DwarfParser::IFileFilter *filter)
 	{
 		Dwarf_Lines* lines;
 		Dwarf_Files *files;
@@ -55,28 +71,59 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 		Dwarf_Die die;
 		unsigned int i;
 
-		if (dwarf_offdie(m_impl->m_dwarf, lastOffset + headerSize, &die) == NULL)
-			continue;
-
-		lastOffset = offset;
-
-		/* Get the source lines */
-		if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
-			continue;
+		if (dwarf_offdie(dwarf, dieOffset, &die) == NULL)
+			return;
 
-		/* And the files */
+		/* Get the files */
 		if (dwarf_getsrcfiles(&die, &files, &fileCount) != 0)
-			continue;
+			return;
 
 		const char *const *srcDirs;
 		size_t ndirs = 0;
 
 		/* Lookup the compilation path */
 		if (dwarf_getsrcdirs(files, &srcDirs, &ndirs) != 0)
-			continue;
+			return;
 
 		if (ndirs == 0)
-			continue;
+			return;
+
+		// The names of the same file share a pointer
+		std::unordered_map<const char *, uint32_t> fileIndexes;
+
+#if _ELFUTILS_PREREQ(0, 191)
+		/*
+		 * Skip the line program if no file in the unit is of interest. Since
+		 * elfutils 0.191, dwarf_getsrcfiles only reads the file table; older
+		 * versions decode the whole line program there, so this would only
+		 * add work and the files are filtered line by line below instead.
+		 */
+		if (filter)
+		{
+			bool included = false;
+
+			for (size_t idx = 0; idx < fileCount; idx++)
+			{
+				const char *name = dwarf_filesrc(files, idx, NULL, NULL);
+
+				if (!name || fileIndexes.find(name) != fileIndexes.end())
+					continue;
+
+				uint32_t index = addFile(out, srcDirs, name, filter);
+
+				fileIndexes[name] = index;
+				if (index != FILE_EXCLUDED)
+					included = true;
+			}
+
+			if (!included)
+				return;
+		}
+#endif
+
+		/* And the source lines */
+		if (dwarf_getsrclines(&die, &lines, &lineCount) != 0)
+			return;
 
 		/* Iterate through the source lines */
 		for (i = 0; i < lineCount; i++)
@@ -111,9 +158,337 @@ void DwarfParser::forEachLine(IFileParser::ILineListener& listener)
 			if (!isCode)
 				continue;
 
-			listener.onLine(fullPath(srcDirs, lineSource), lineNr, addr);
+			std::unordered_map<const char *, uint32_t>::iterator it = fileIndexes.find(lineSource);
+			if (it == fileIndexes.end())
+				it = fileIndexes.insert(std::make_pair(lineSource, addFile(out, srcDirs, lineSource, filter))).first;
+
+			if (it->second == FILE_EXCLUDED)
+				continue;
+
+			out.m_lines[it->second].push_back(std::make_pair((unsigned int) lineNr, (uint64_t) addr));
 		}
 	}
+
+	// Thread-safe as long as each thread has its own @a dwarf
+	static void decodeFunctions(Dwarf *dwarf, Dwarf_Off dieOffset, Unit &out)
+	{
+		Dwarf_Die die;
+
+		if (dwarf_offdie(dwarf, dieOffset, &die) == NULL)
+			return;
+
+		if (!getSplitUnit(die))
+			return;
+
+		dwarf_getfuncs(&die, onFunctionDie, (void *) &out, 0);
+	}
+
+	/*
+	 * The DIEs of a split DWARF unit are in its .dwo file or the .dwp package,
+	 * which libdw opens when it's asked for them. Only the skeleton, with
+	 * the line table, is in the file itself.
+	 */
+	static bool getSplitUnit(Dwarf_Die &die)
+	{
+#if _ELFUTILS_PREREQ(0, 171)
+		Dwarf_Die subdie;
+		uint8_t unitType;
+
+		if (dwarf_cu_info(die.cu, NULL, &unitType, NULL, &subdie, NULL, NULL, NULL) != 0 ||
+				unitType != DW_UT_skeleton)
+			return true;
+
+		if (subdie.addr == NULL)
+		{
+			const char *name = dwarf_diename(&die);
+
+			kcov_debug(ELF_MSG, "Can't find the split DWARF unit of %s\n", name ? name : "?");
+			return false;
+		}
+
+		die = subdie;
+#endif
+
+		return true;
+	}
+
+	static int onFunctionDie(Dwarf_Die *die, void *arg)
+	{
+		Unit *out = (Unit *) arg;
+		Dwarf_Addr low, high;
+
+		// Declarations and functions with non-contiguous ranges have no low/high pc
+		if (dwarf_lowpc(die, &low) == 0 && dwarf_highpc(die, &high) == 0 && high > low)
+			out->m_functions.push_back(std::make_pair((uint64_t) low, (uint64_t) high));
+
+		return DWARF_CB_OK;
+	}
+
+	// The index of the file in @a out, or FILE_EXCLUDED
+	static uint32_t addFile(Unit &out, const char *const *srcDirs, const char *name, DwarfParser::IFileFilter *filter)
+	{
+		std::string path = fullPath(srcDirs, name);
+
+		if (filter && !filter->includeFile(path))
+			return FILE_EXCLUDED;
+
+		out.m_files.push_back(path);
+		out.m_lines.resize(out.m_files.size());
+
+		return out.m_files.size() - 1;
+	}
+
+	static void reportUnit(const Unit &unit, IFileParser::ILineListener &listener)
+	{
+		for (size_t i = 0; i < unit.m_files.size(); i++)
+		{
+			// Files in the table without lines
+			if (!unit.m_lines[i].empty())
+				listener.onLines(unit.m_files[i], unit.m_lines[i]);
+		}
+	}
+
+	static void reportFunctions(const Unit &unit, IFileParser::IFunctionListener &listener)
+	{
+		for (size_t i = 0; i < unit.m_functions.size(); i++)
+			listener.onFunction(unit.m_functions[i].first, unit.m_functions[i].second);
+	}
+
+	int m_fd;
+	Dwarf *m_dwarf;
+	std::string m_filename;
+};
+
+/*
+ * Threads which decode the compilation units of the files in forEachLine() and
+ * forEachFunction(). libdw isn't thread-safe, so each thread opens the file
+ * itself, and the .dwo files of split units it decodes. The caller decodes
+ * units as well, and reports them in order as they become ready.
+ */
+class DwarfParser::LineWorkers
+{
+public:
+	LineWorkers(unsigned int nThreads)
+	{
+		for (unsigned int i = 0; i < nThreads; i++)
+		{
+			pthread_t thread;
+
+			if (pthread_create(&thread, NULL, LineWorkers::threadStatic, (void *) this) == 0)
+				pthread_detach(thread);
+		}
+	}
+
+	// The lines of @a units to @a lineListener, or the functions to @a functionListener
+	void run(Impl &impl, const std::vector<Dwarf_Off> &units, IFileParser::ILineListener *lineListener,
+			IFileParser::IFunctionListener *functionListener, DwarfParser::IFileFilter *filter)
+	{
+		Job job(impl.m_filename, units, filter, functionListener != NULL);
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_jobs.push_back(&job);
+		m_queued.notify_all();
+
+		for (size_t i = 0; i < units.size(); i++)
+		{
+			while (!job.m_done[i])
+			{
+				if (job.m_next < units.size())
+				{
+					size_t cur = job.m_next++;
+
+					lock.unlock();
+					job.decode(impl.m_dwarf, cur);
+					lock.lock();
+
+					job.m_done[cur] = true;
+				}
+				else
+				{
+					m_unitDone.wait(lock);
+				}
+			}
+
+			Impl::Unit unit;
+
+			std::swap(unit, job.m_results[i]);
+			lock.unlock();
+			if (functionListener)
+				Impl::reportFunctions(unit, *functionListener);
+			else
+				Impl::reportUnit(unit, *lineListener);
+			lock.lock();
+		}
+
+		// Threads which are late to find the job empty still refer to it
+		JobList_t::iterator it = std::find(m_jobs.begin(), m_jobs.end(), &job);
+		if (it != m_jobs.end())
+			m_jobs.erase(it);
+
+		while (job.m_workers > 0)
+			m_unitDone.wait(lock);
+	}
+
+private:
+	class Job
+	{
+	public:
+		Job(const std::string &filename, const std::vector<Dwarf_Off> &units, DwarfParser::IFileFilter *filter,
+				bool functions) :
+			m_filename(filename), m_units(units), m_filter(filter), m_functions(functions),
+			m_results(units.size()), m_done(units.size(), false), m_next(0), m_workers(0)
+		{
+		}
+
+		void decode(Dwarf *dwarf, size_t cur)
+		{
+			if (m_functions)
+				Impl::decodeFunctions(dwarf, m_units[cur], m_results[cur]);
+			else
+				Impl::decodeUnit(dwarf, m_units[cur], m_results[cur], m_filter);
+		}
+
+		const std::string m_filename;
+		const std::vector<Dwarf_Off> &m_units;
+		DwarfParser::IFileFilter *m_filter;
+		const bool m_functions;
+		std::vector<Impl::Unit> m_results;
+		std::vector<bool> m_done;
+		size_t m_next;
+		unsigned int m_workers;
+	};
+
+	typedef std::deque<Job *> JobList_t;
+
+	void work(Job *job)
+	{
+		DwarfParser dp;
+		bool opened = dp.open(job->m_filename);
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		// Leave it to the caller then
+		if (!opened && !m_jobs.empty() && m_jobs.front() == job)
+			m_jobs.pop_front();
+
+		while (opened && job->m_next < job->m_units.size())
+		{
+			size_t cur = job->m_next++;
+
+			lock.unlock();
+			job->decode(dp.m_impl->m_dwarf, cur);
+			lock.lock();
+
+			job->m_done[cur] = true;
+			m_unitDone.notify_all();
+		}
+
+		job->m_workers--;
+		m_unitDone.notify_all();
+	}
+
+	void threadMain()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		while (1)
+		{
+			while (m_jobs.empty())
+				m_queued.wait(lock);
+
+			Job *job = m_jobs.front();
+
+			if (job->m_next == job->m_units.size())
+			{
+				m_jobs.pop_front();
+				continue;
+			}
+
+			job->m_workers++;
+			lock.unlock();
+			work(job);
+			lock.lock();
+		}
+	}
+
+	static void *threadStatic(void *pThis)
+	{
+		LineWorkers *p = (LineWorkers *) pThis;
+
+		p->threadMain();
+
+		return NULL;
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_queued;
+	std::condition_variable m_unitDone;
+	JobList_t m_jobs;
+};
+
+// Never deleted, since the threads run until kcov exits
+DwarfParser::LineWorkers *DwarfParser::g_lineWorkers;
+
+DwarfParser::DwarfParser()
+{
+	m_impl = new DwarfParser::Impl();
+}
+
+DwarfParser::~DwarfParser()
+{
+	close();
+	delete m_impl;
+}
+
+void DwarfParser::startLineWorkers(unsigned int nThreads)
+{
+	if (!g_lineWorkers && nThreads > 0)
+		g_lineWorkers = new LineWorkers(nThreads);
+}
+
+void DwarfParser::forEachLine(IFileParser::ILineListener& listener, IFileFilter *filter)
+{
+	if (!m_impl->m_dwarf)
+		return;
+
+	std::vector<Dwarf_Off> units = m_impl->getUnits();
+
+	// Not worth opening the file again in the threads for a few units
+	if (g_lineWorkers && units.size() >= 16)
+	{
+		g_lineWorkers->run(*m_impl, units, &listener, NULL, filter);
+		return;
+	}
+
+	for (std::vector<Dwarf_Off>::const_iterator it = units.begin(); it != units.end(); ++it)
+	{
+		Impl::Unit unit;
+
+		Impl::decodeUnit(m_impl->m_dwarf, *it, unit, filter);
+		Impl::reportUnit(unit, listener);
+	}
+}
+
+void DwarfParser::forEachFunction(IFileParser::IFunctionListener& listener)
+{
+	if (!m_impl->m_dwarf)
+		return;
+
+	std::vector<Dwarf_Off> units = m_impl->getUnits();
+
+	// Split units open a .dwo file each, so that's also done in the threads
+	if (g_lineWorkers && units.size() >= 16)
+	{
+		g_lineWorkers->run(*m_impl, units, NULL, &listener, NULL);
+		return;
+	}
+
+	for (std::vector<Dwarf_Off>::const_iterator it = units.begin(); it != units.end(); ++it)
+	{
+		Impl::Unit unit;
+
+		Impl::decodeFunctions(m_impl->m_dwarf, *it, unit);
+		Impl::reportFunctions(unit, listener);
+	}
 }
 
 void DwarfParser::forAddress(IFileParser::ILineListener& listener, uint64_t address)
@@ -198,6 +573,7 @@ bool DwarfParser::open(const std::string& filename)
 	close();
 
 	m_impl->m_fd = ::open(filename.c_str(), O_RDONLY);
+	m_impl->m_filename = filename;
 
 	if (m_impl->m_fd < 0)
 		return false;
@@ -10,20 +10,75 @@ namespace kcov
 	class DwarfParser
 	{
 	public:
+		/**
+		 * Filter for the source files of the compilation units, see forEachLine()
+		 */
+		class IFileFilter
+		{
+		public:
+			virtual ~IFileFilter()
+			{
+			}
+
+			/**
+			 * Check if the lines of a file should be reported. Can be called
+			 * from any thread.
+			 *
+			 * @param file the file, as it would be reported
+			 *
+			 * @return true if the file should be reported
+			 */
+			virtual bool includeFile(const std::string &file) = 0;
+		};
+
 		DwarfParser();
 
 		~DwarfParser();
 
 		bool open(const std::string &filename);
 
-		void forEachLine(IFileParser::ILineListener &listener);
+		/**
+		 * Report the source lines of all compilation units
+		 *
+		 * @param listener the listener to report to
+		 * @param filter if given, the lines of files it excludes are not reported,
+		 *        and units where it excludes all files are not decoded at all
+		 */
+		void forEachLine(IFileParser::ILineListener &listener, IFileFilter *filter = NULL);
+
+		/**
+		 * Report the functions of all compilation units
+		 *
+		 * The lines of split DWARF (-gsplit-dwarf) units are in the skeleton
+		 * units of the file, but their functions are read from the .dwo files
+		 * or the .dwp package.
+		 *
+		 * @param listener the listener to report to
+		 */
+		void forEachFunction(IFileParser::IFunctionListener &listener);
 
 		void forAddress(IFileParser::ILineListener &listener, uint64_t address);
 
+		/**
+		 * Start threads which help forEachLine() and forEachFunction() decode
+		 * the compilation units
+		 *
+		 * The units are still reported in order, from the calling thread. Threads
+		 * get the CPU affinity of their creator, so this should be called before
+		 * kcov is tied to a CPU.
+		 *
+		 * @param nThreads the number of threads to start
+		 */
+		static void startLineWorkers(unsigned int nThreads);
+
 	private:
 		class Impl;
+		class LineWorkers;
+
+		// Shared by all parsers, see startLineWorkers()
+		static LineWorkers *g_lineWorkers;
 
-		std::string fullPath(const char *const *srcDirs, const std::string &filename);
+		static std::string fullPath(const char *const *srcDirs, const std::string &filename);
 
 		void close();
 
@@ -8,12 +8,18 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <libelf.h>
 #include <dwarf.h>
 #include <elfutils/libdw.h>
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <string>
 #include <configuration.hh>
@@ -25,6 +31,7 @@
 
 #include <filter.hh>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "dwarf.hh"
 
@@ -36,7 +43,291 @@ enum SymbolType
 };
 typedef std::vector<Segment> SegmentList_t;
 
-class ElfInstance : public IFileParser, IFileParser::ILineListener
+/*
+ * The lines and functions of a file, as read from the DWARF information
+ * by preparseFile() or from the line cache. They are filtered and relocated
+ * when reported.
+ */
+class PreparsedFile : public IFileParser::ILineListener, public IFileParser::IFunctionListener
+{
+public:
+	PreparsedFile() : m_elf(NULL), m_hasDwarf(false)
+	{
+	}
+
+	virtual ~PreparsedFile()
+	{
+	}
+
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		onLines(file, LineAddrList_t(1, std::make_pair(lineNr, addr)));
+	}
+
+	void onLines(const std::string &file, const LineAddrList_t &lines)
+	{
+		// The lines of a file mostly come together
+		if (m_files.empty() || m_files.back() != file)
+			m_files.push_back(file);
+
+		for (LineAddrList_t::const_iterator it = lines.begin(); it != lines.end(); ++it)
+			m_lines.push_back(Line(m_files.size() - 1, it->first, it->second));
+	}
+
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		m_functions.push_back(Function(start, end));
+	}
+
+	void report(IFileParser::ILineListener &lineListener, IFileParser::IFunctionListener &functionListener) const
+	{
+		for (FunctionList_t::const_iterator it = m_functions.begin(); it != m_functions.end(); ++it)
+			functionListener.onFunction(it->m_start, it->m_end);
+
+		LineAddrList_t batch;
+
+		for (LineList_t::const_iterator it = m_lines.begin(); it != m_lines.end(); ++it)
+		{
+			batch.push_back(std::make_pair(it->m_lineNr, it->m_addr));
+
+			if (it + 1 == m_lines.end() || (it + 1)->m_file != it->m_file)
+			{
+				lineListener.onLines(m_files[it->m_file], batch);
+				batch.clear();
+			}
+		}
+	}
+
+	/*
+	 * Read the tables from a line cache file, which holds the header, the
+	 * functions, the lines, the build-id and the NUL-terminated file names.
+	 */
+	bool load(const std::string &path, const std::string &buildId)
+	{
+		struct stat st;
+		bool out = false;
+		int fd;
+
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(LineCacheHeader))
+		{
+			close(fd);
+			return false;
+		}
+
+		size_t size = st.st_size;
+		void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (data == MAP_FAILED)
+			return false;
+
+		const LineCacheHeader *hdr = (const LineCacheHeader *) data;
+
+		if (hdr->m_magic == LINE_CACHE_MAGIC && hdr->m_version == LINE_CACHE_VERSION &&
+				hdr->size() == size)
+		{
+			const Function *functions = (const Function *) (hdr + 1);
+			const Line *lines = (const Line *) (functions + hdr->m_nFunctions);
+			const char *id = (const char *) (lines + hdr->m_nLines);
+			const char *names = id + hdr->m_buildIdSize;
+
+			out = std::string(id, hdr->m_buildIdSize) == buildId &&
+					(hdr->m_namesSize == 0 || names[hdr->m_namesSize - 1] == '\0');
+			if (out)
+			{
+				m_functions.assign(functions, functions + hdr->m_nFunctions);
+				m_lines.assign(lines, lines + hdr->m_nLines);
+				m_files.clear();
+				for (const char *cur = names; cur < names + hdr->m_namesSize; cur += strlen(cur) + 1)
+					m_files.push_back(cur);
+			}
+
+			// Broken file?
+			for (LineList_t::const_iterator it = m_lines.begin(); out && it != m_lines.end(); ++it)
+				out = it->m_file < m_files.size();
+		}
+
+		munmap(data, size);
+
+		return out;
+	}
+
+	// Written to a temporary file first, since other kcov instances can read it
+	bool save(const std::string &path, const std::string &buildId) const
+	{
+		static std::atomic<unsigned int> tmpCount(0);
+		LineCacheHeader hdr;
+		std::string names;
+
+		for (FileList_t::const_iterator it = m_files.begin(); it != m_files.end(); ++it)
+			names.append(it->c_str(), it->size() + 1);
+
+		hdr.m_magic = LINE_CACHE_MAGIC;
+		hdr.m_version = LINE_CACHE_VERSION;
+		hdr.m_nFunctions = m_functions.size();
+		hdr.m_nLines = m_lines.size();
+		hdr.m_buildIdSize = buildId.size();
+		hdr.m_namesSize = names.size();
+
+		uint8_t *data = (uint8_t *) xmalloc(hdr.size());
+		uint8_t *p = data;
+
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+		if (!m_functions.empty())
+			memcpy(p, m_functions.data(), m_functions.size() * sizeof(Function));
+		p += m_functions.size() * sizeof(Function);
+		if (!m_lines.empty())
+			memcpy(p, m_lines.data(), m_lines.size() * sizeof(Line));
+		p += m_lines.size() * sizeof(Line);
+		memcpy(p, buildId.c_str(), buildId.size());
+		p += buildId.size();
+		memcpy(p, names.c_str(), names.size());
+
+		std::string tmp = fmt("%s.%d-%u", path.c_str(), getpid(), tmpCount++);
+		bool out = write_file(data, hdr.size(), "%s", tmp.c_str()) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+
+		if (!out)
+			unlink(tmp.c_str());
+		free(data);
+
+		return out;
+	}
+
+	IElf *m_elf;
+	bool m_hasDwarf;
+
+private:
+	enum
+	{
+		LINE_CACHE_MAGIC = 0x6b636c74, // "kclt"
+		LINE_CACHE_VERSION = 1,
+	};
+
+	struct LineCacheHeader
+	{
+		uint64_t size() const
+		{
+			return sizeof(*this) + (uint64_t) m_nFunctions * sizeof(Function) + (uint64_t) m_nLines * sizeof(Line) +
+					m_buildIdSize + m_namesSize;
+		}
+
+		uint32_t m_magic;
+		uint32_t m_version;
+		uint32_t m_nFunctions;
+		uint32_t m_nLines;
+		uint32_t m_buildIdSize;
+		uint32_t m_namesSize;
+	};
+
+	struct Function
+	{
+		Function(uint64_t start, uint64_t end) :
+				m_start(start), m_end(end)
+		{
+		}
+
+		uint64_t m_start;
+		uint64_t m_end;
+	};
+
+	// Without padding, so that it can be written as is
+	struct Line
+	{
+		Line(uint32_t file, uint32_t lineNr, uint64_t addr) :
+				m_addr(addr), m_file(file), m_lineNr(lineNr)
+		{
+		}
+
+		uint64_t m_addr;
+		uint32_t m_file;
+		uint32_t m_lineNr;
+	};
+
+	typedef std::vector<std::string> FileList_t;
+	typedef std::vector<Line> LineList_t;
+	typedef std::vector<Function> FunctionList_t;
+
+	FileList_t m_files;
+	LineList_t m_lines;
+	FunctionList_t m_functions;
+};
+
+/*
+ * The segments of a file sorted by address, for binary searches instead of
+ * checking every segment for every line. Segments don't overlap, and the
+ * lines of a file mostly come in order, so the last match is tried first.
+ */
+class SegmentIndex
+{
+public:
+	SegmentIndex() : m_last(NULL)
+	{
+	}
+
+	// The segments are referred to, and can't change until the next build()
+	void build(const SegmentList_t &segments)
+	{
+		m_segments.clear();
+		m_last = NULL;
+
+		for (SegmentList_t::const_iterator it = segments.begin(); it != segments.end(); ++it)
+		{
+			if (it->getSize() > 0)
+				m_segments.push_back(&*it);
+		}
+
+		std::sort(m_segments.begin(), m_segments.end(), SegmentIndex::startsBefore);
+	}
+
+	void clear()
+	{
+		m_segments.clear();
+		m_last = NULL;
+	}
+
+	// The segment @a addr is in, or NULL
+	const Segment *lookup(uint64_t addr)
+	{
+		if (m_last && m_last->addressIsWithinSegment(addr))
+			return m_last;
+
+		// The last segment starting at or before addr
+		std::vector<const Segment *>::const_iterator it = std::upper_bound(m_segments.begin(), m_segments.end(),
+				addr, SegmentIndex::addrBefore);
+		if (it == m_segments.begin())
+			return NULL;
+		--it;
+
+		if (!(*it)->addressIsWithinSegment(addr))
+			return NULL;
+
+		m_last = *it;
+
+		return m_last;
+	}
+
+private:
+	static bool startsBefore(const Segment *a, const Segment *b)
+	{
+		return a->getStart() < b->getStart();
+	}
+
+	static bool addrBefore(uint64_t addr, const Segment *segment)
+	{
+		return addr < segment->getStart();
+	}
+
+	std::vector<const Segment *> m_segments;
+	const Segment *m_last;
+};
+
+class ElfInstance : public IFileParser, IFileParser::ILineListener, IFileParser::IFunctionListener,
+		DwarfParser::IFileFilter
 {
 public:
 	ElfInstance() : m_addressVerifier(IDisassembler::getInstance())
@@ -50,6 +341,9 @@ public:
 		m_initialized = false;
 		m_filter = NULL;
 		m_verifyAddresses = false;
+		m_filterUnits = false;
+		m_readFunctions = false;
+		m_mainPreparsing = false;
 		m_debuglinkCrc = 0;
 		m_relocation = 0;
 		m_invalidBreakpoints = 0;
@@ -59,6 +353,17 @@ public:
 
 	virtual ~ElfInstance()
 	{
+		if (m_mainPreparsing)
+			pthread_join(m_mainPreparseThread, NULL);
+
+		// Solibs which were read but never reported, e.g., when the tracee exited first
+		for (PreparsedFileMap_t::iterator it = m_preparsedFiles.begin(); it != m_preparsedFiles.end(); ++it)
+		{
+			delete it->second->m_elf;
+			delete it->second;
+		}
+
+		delete m_elf;
 	}
 
 	uint64_t getChecksum()
@@ -79,6 +384,15 @@ public:
 	void setupParser(IFilter *filter)
 	{
 		m_filter = filter;
+		m_readFunctions = !m_functionListeners.empty() || m_verifyAddresses;
+
+		// PIEs are parsed once the program has started and the relocation is known. Read it meanwhile
+		if (m_isMainFile && m_elfIsShared && IConfiguration::getInstance().keyAsInt("parse-solibs"))
+		{
+			m_mainPreparseFilename = m_filename;
+			m_mainPreparsing = pthread_create(&m_mainPreparseThread, NULL,
+					ElfInstance::mainPreparseThreadStatic, (void *) this) == 0;
+		}
 	}
 
 	enum IFileParser::PossibleHits maxPossibleHits()
@@ -101,6 +415,20 @@ public:
 		if (!m_initialized)
 		{
 			m_verifyAddresses = IConfiguration::getInstance().keyAsInt("verify");
+			m_lineCacheDir = IConfiguration::getInstance().keyAsString("line-cache");
+
+			// Only worth looking at the files of compilation units with filters
+			IConfiguration &conf = IConfiguration::getInstance();
+			m_filterUnits = !conf.keyAsList("include-path").empty() || !conf.keyAsList("exclude-path").empty() ||
+					!conf.keyAsList("include-pattern").empty() || !conf.keyAsList("exclude-pattern").empty();
+
+			// The parent directory has to exist
+			if (m_lineCacheDir != "")
+				(void) mkdir(m_lineCacheDir.c_str(), 0755);
+
+			// Before the engine ties kcov to a CPU. The parsing thread decodes lines as well
+			long nCpus = std::min(std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L), 16L);
+			DwarfParser::startLineWorkers(nCpus - 1);
 
 			panic_if(elf_version(EV_CURRENT) == EV_NONE, "ELF version failed\n");
 			m_initialized = true;
@@ -113,6 +441,8 @@ public:
 
 		m_curSegments.clear();
 		m_executableSegments.clear();
+		m_curSegmentIndex.clear();
+		m_executableSegmentIndex.clear();
 		for (uint32_t i = 0; data && i < data->n_segments; i++)
 		{
 			struct phdr_data_segment *seg = &data->segments[i];
@@ -211,24 +541,90 @@ public:
 
 	bool doParse(unsigned long relocation)
 	{
+		// Solibs are read in the background by the solib handler, and PIEs by setupParser()
+		PreparsedFile *preparsed = takePreparsedFile(m_filename);
 		struct stat st;
 
 		if (lstat(m_filename.c_str(), &st) < 0)
+		{
+			if (preparsed)
+				delete preparsed->m_elf;
+			delete preparsed;
+
 			return false;
+		}
 
-		parseOneElf();
+		parseOneElf(preparsed);
 
 		setupSections();
 
-		parseOneDwarf(relocation);
+		m_curSegmentIndex.build(m_curSegments);
+		m_executableSegmentIndex.build(m_executableSegments);
+
+		parseOneDwarf(relocation, preparsed);
+
+		delete preparsed;
 
 		return true;
 	}
 
+	/*
+	 * Called from the solib handler's parser threads. Apart from the map of
+	 * preparsed files, this (and readDwarf()) may only use the filter, the line
+	 * cache directory and m_readFunctions, which are fixed once setupParser()
+	 * has been called.
+	 */
+	void preparseFile(const std::string &filename)
+	{
+		preparse(filename, false);
+	}
+
+	static void *mainPreparseThreadStatic(void *pThis)
+	{
+		ElfInstance *p = (ElfInstance *) pThis;
+
+		p->preparse(p->m_mainPreparseFilename, true);
+
+		return NULL;
+	}
+
+	void preparse(const std::string &filename, bool isMainFile)
+	{
+		PreparsedFile *p = new PreparsedFile();
+
+		p->m_elf = IElf::create(filename);
+		if (p->m_elf)
+		{
+			const std::pair<std::string, uint32_t> *dbgLink = p->m_elf->getDebugLink();
+
+			p->m_hasDwarf = readDwarf(*p, filename, p->m_elf->getBuildId(),
+					dbgLink ? dbgLink->first : "", dbgLink ? dbgLink->second : 0, isMainFile);
+		}
+
+		std::lock_guard<std::mutex> lock(m_preparsedMutex);
+		PreparsedFileMap_t::iterator it = m_preparsedFiles.find(filename);
+
+		if (it != m_preparsedFiles.end())
+		{
+			// The parser takes over the ELF when the file is parsed, see parseOneElf()
+			delete it->second->m_elf;
+			delete it->second;
+		}
+
+		m_preparsedFiles[filename] = p;
+	}
+
 	bool setMainFileRelocation(unsigned long relocation)
 	{
 		kcov_debug(INFO_MSG, "main file relocation = %#lx\n", relocation);
 
+		// Wait for the lines read since setupParser(), and use them below
+		if (m_mainPreparsing)
+		{
+			pthread_join(m_mainPreparseThread, NULL);
+			m_mainPreparsing = false;
+		}
+
 		if (m_elfIsShared)
 		{
 			if (!doParse(relocation))
@@ -252,42 +648,99 @@ public:
 	{
 		for (SegmentList_t::const_iterator it = m_executableSegments.begin(); it != m_executableSegments.end(); ++it)
 		{
-			m_addressVerifier.addSection(it->getData(), it->getSize(), it->getBase());
+			m_addressVerifier.addSection(it->getSharedData(), it->getSize(), it->getBase());
 		}
 	}
 
-	bool parseOneDwarf(unsigned long relocation)
+	bool openDwarf(DwarfParser &dp, const std::string &filename, const std::string &buildId,
+			const std::string &debuglink, uint32_t debuglinkCrc, bool isMainFile)
 	{
-		m_invalidBreakpoints = 0;
-		m_relocation = relocation;
-
-		DwarfParser dp;
-
-		bool rv = dp.open(m_filename);
+		bool rv = dp.open(filename);
 
-		if (!rv && m_buildId.length() > 0)
+		if (!rv && buildId.length() > 0)
 		{
 			/* Look for separate debug info: build-ids */
 			std::string debug_file = std::string(
-					"/usr/lib/debug/.build-id/" + m_buildId.substr(0, 2) + "/" + m_buildId.substr(2, std::string::npos)
+					"/usr/lib/debug/.build-id/" + buildId.substr(0, 2) + "/" + buildId.substr(2, std::string::npos)
 							+ ".debug");
 
 			rv = dp.open(debug_file);
-			if (!rv && m_isMainFile)
+			if (!rv && isMainFile)
 				kcov_debug(ELF_MSG, "Cannot open %s\n", debug_file.c_str());
 		}
 
-		if (!rv && m_debuglink.length() > 0)
+		if (!rv && debuglink.length() > 0)
 		{
 			/* Look for separate debug info: debug-links */
-			std::string debugPath = lookupDebuglinkFile();
+			std::string debugPath = lookupDebuglinkFile(filename, debuglink, debuglinkCrc);
 
-			if (debugPath == "" && m_isMainFile)
+			if (debugPath == "" && isMainFile)
 				kcov_debug(ELF_MSG, "Cannot open debug-link file in standard locations\n");
 			else
 				rv = dp.open(debugPath);
 		}
 
+		return rv;
+	}
+
+	/*
+	 * Read the lines and functions of a file into @a out, from the line cache
+	 * if it has them (see --line-cache). Can be called from any thread.
+	 */
+	bool readDwarf(PreparsedFile &out, const std::string &filename, const std::string &buildId,
+			const std::string &debuglink, uint32_t debuglinkCrc, bool isMainFile)
+	{
+		std::string cachePath;
+
+		if (m_lineCacheDir != "" && buildId != "")
+			cachePath = fmt("%s/%s.lines", m_lineCacheDir.c_str(), buildId.c_str());
+
+		if (cachePath != "" && out.load(cachePath, buildId))
+		{
+			kcov_debug(ELF_MSG, "Lines of %s read from %s\n", filename.c_str(), cachePath.c_str());
+			return true;
+		}
+
+		DwarfParser dp;
+
+		if (!openDwarf(dp, filename, buildId, debuglink, debuglinkCrc, isMainFile))
+			return false;
+
+		// The cache holds the functions and the lines even if no one listens for them
+		if (cachePath != "" || m_readFunctions)
+			dp.forEachFunction(out);
+		dp.forEachLine(out, cachePath == "" && m_filterUnits ? this : NULL);
+
+		if (cachePath != "" && !out.save(cachePath, buildId))
+			kcov_debug(ELF_MSG, "Can't write line cache %s\n", cachePath.c_str());
+
+		return true;
+	}
+
+	bool parseOneDwarf(unsigned long relocation, const PreparsedFile *preparsed)
+	{
+		m_invalidBreakpoints = 0;
+		m_relocation = relocation;
+		m_reportedBasicBlocks.clear();
+
+		PreparsedFile cached;
+		DwarfParser dp;
+		bool rv;
+
+		if (preparsed)
+		{
+			rv = preparsed->m_hasDwarf;
+		}
+		else if (m_lineCacheDir != "")
+		{
+			rv = readDwarf(cached, m_filename, m_buildId, m_debuglink, m_debuglinkCrc, m_isMainFile);
+			preparsed = &cached;
+		}
+		else
+		{
+			rv = openDwarf(dp, m_filename, m_buildId, m_debuglink, m_debuglinkCrc, m_isMainFile);
+		}
+
 		if (!rv)
 		{
 			if (m_isMainFile)
@@ -298,8 +751,19 @@ public:
 			return false;
 		}
 
-		/* Iterate over the headers */
-		dp.forEachLine(*this);
+		if (preparsed)
+		{
+			preparsed->report(*this, *this);
+		}
+		else
+		{
+			// Functions first, so that the lines can be placed in them
+			if (m_readFunctions)
+				dp.forEachFunction(*this);
+
+			/* Iterate over the headers */
+			dp.forEachLine(*this, m_filterUnits ? this : NULL);
+		}
 
 		if (m_invalidBreakpoints > 0)
 		{
@@ -309,9 +773,11 @@ public:
 		return true;
 	}
 
-	bool parseOneElf()
+	bool parseOneElf(const PreparsedFile *preparsed)
 	{
-		m_elf = IElf::create(m_filename);
+		// The segments and the disassembler keep what they need of the previous file
+		delete m_elf;
+		m_elf = preparsed ? preparsed->m_elf : IElf::create(m_filename);
 
 		if (!m_elf)
 			return false;
@@ -351,107 +817,186 @@ public:
 		m_fileListeners.push_back(&listener);
 	}
 
+	void registerFunctionListener(IFileParser::IFunctionListener &listener)
+	{
+		m_functionListeners.push_back(&listener);
+	}
+
+	void registerBasicBlockListener(IFileParser::IBasicBlockListener &listener)
+	{
+		m_basicBlockListeners.push_back(&listener);
+	}
+
 private:
 	typedef std::vector<IFileParser::ILineListener *> LineListenerList_t;
 	typedef std::vector<IFileListener *> FileListenerList_t;
+	typedef std::vector<IFileParser::IFunctionListener *> FunctionListenerList_t;
+	typedef std::vector<IFileParser::IBasicBlockListener *> BasicBlockListenerList_t;
 	typedef std::vector<std::string> FileList_t;
 
-	bool addressIsValid(uint64_t addr, unsigned &invalidBreakpoints) const
-	{
-		for (SegmentList_t::const_iterator it = m_executableSegments.begin(); it != m_executableSegments.end(); ++it)
-		{
-			if (it->addressIsWithinSegment(addr))
-			{
-				bool out = true;
+	typedef std::unordered_map<std::string, PreparsedFile *> PreparsedFileMap_t;
 
-				if (m_verifyAddresses)
-				{
-					out = m_addressVerifier.verify(addr);
+	PreparsedFile *takePreparsedFile(const std::string &filename)
+	{
+		std::lock_guard<std::mutex> lock(m_preparsedMutex);
+		PreparsedFileMap_t::iterator it = m_preparsedFiles.find(filename);
 
-					if (!out)
-					{
-						kcov_debug(ELF_MSG, "kcov: Address 0x%llx is not at an instruction boundary, skipping\n",
-								(unsigned long long) addr);
-						invalidBreakpoints++;
-					}
-				}
+		if (it == m_preparsedFiles.end())
+			return NULL;
 
-				return out;
-			}
-		}
+		PreparsedFile *out = it->second;
+		m_preparsedFiles.erase(it);
 
-		return false;
+		return out;
 	}
 
-	uint64_t adjustAddressBySegment(uint64_t addr)
+	bool addressIsValid(uint64_t addr, unsigned &invalidBreakpoints)
 	{
-		for (SegmentList_t::const_iterator it = m_curSegments.begin(); it != m_curSegments.end(); ++it)
+		if (!m_executableSegmentIndex.lookup(addr))
+			return false;
+
+		bool out = true;
+
+		if (m_verifyAddresses)
 		{
-			if (it->addressIsWithinSegment(addr))
+			out = m_addressVerifier.verify(addr);
+
+			if (!out)
 			{
-				addr = it->adjustAddress(addr);
-				break;
+				kcov_debug(ELF_MSG, "kcov: Address 0x%llx is not at an instruction boundary, skipping\n",
+						(unsigned long long) addr);
+				invalidBreakpoints++;
 			}
 		}
 
+		return out;
+	}
+
+	uint64_t adjustAddressBySegment(uint64_t addr)
+	{
+		const Segment *segment = m_curSegmentIndex.lookup(addr);
+
+		if (segment)
+			addr = segment->adjustAddress(addr);
+
 		return addr;
 	}
 
 	// From IFileParser::ILineListener
 	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
 	{
-		if (!addressIsValid(addr, m_invalidBreakpoints))
+		onLines(file, LineAddrList_t(1, std::make_pair(lineNr, addr)));
+	}
+
+	void onLines(const std::string &file, const LineAddrList_t &lines)
+	{
+		LineAddrList_t out;
+
+		out.reserve(lines.size());
+		for (LineAddrList_t::const_iterator it = lines.begin(); it != lines.end(); ++it)
+		{
+			if (!addressIsValid(it->second, m_invalidBreakpoints))
+				continue;
+
+			if (!m_basicBlockListeners.empty())
+				reportBasicBlock(it->second);
+
+			out.push_back(std::make_pair(it->first, adjustAddressBySegment(it->second) + m_relocation));
+		}
+
+		if (out.empty())
 			return;
 
+		// Once for all lines, since the real path is looked up
 		std::string rp = m_filter->mangleSourcePath(file);
 
 		for (LineListenerList_t::const_iterator it = m_lineListeners.begin(); it != m_lineListeners.end(); ++it)
-			(*it)->onLine(rp, lineNr, adjustAddressBySegment(addr) + m_relocation);
+			(*it)->onLines(rp, out);
+	}
+
+	// From DwarfParser::IFileFilter, the collector and reporter filter the same way
+	bool includeFile(const std::string &file)
+	{
+		return m_filter->runFilters(m_filter->mangleSourcePath(file));
+	}
+
+	void reportBasicBlock(uint64_t addr)
+	{
+		const std::vector<uint64_t> &bb = m_addressVerifier.getBasicBlock(addr);
+
+		// Nothing to gain for single-instruction blocks
+		if (bb.size() < 2 || !m_reportedBasicBlocks.insert(bb.front()).second)
+			return;
+
+		uint64_t first = adjustAddressBySegment(bb.front()) + m_relocation;
+		uint64_t last = adjustAddressBySegment(bb.back()) + m_relocation;
+
+		for (BasicBlockListenerList_t::const_iterator it = m_basicBlockListeners.begin(); it != m_basicBlockListeners.end(); ++it)
+			(*it)->onBasicBlock(first, last);
+	}
+
+	// From IFileParser::IFunctionListener
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		unsigned int invalid = 0;
+
+		// Verification only decodes the functions with breakpoints
+		if (m_verifyAddresses)
+			m_addressVerifier.addFunction(start, end);
+
+		if (m_functionListeners.empty() || !addressIsValid(start, invalid))
+			return;
+
+		uint64_t adjusted = adjustAddressBySegment(start) + m_relocation;
+
+		for (FunctionListenerList_t::const_iterator it = m_functionListeners.begin(); it != m_functionListeners.end(); ++it)
+			(*it)->onFunction(adjusted, adjusted + (end - start));
 	}
 
-	std::string tryDebugLink(const std::string &path)
+	std::string tryDebugLink(const std::string &path, uint32_t debuglinkCrc)
 	{
 		if (!file_exists(path))
 			return "";
 
 		size_t sz;
-		uint8_t *p = (uint8_t *) read_file(&sz, "%s", path.c_str());
+		uint8_t *p = (uint8_t *) map_file(&sz, "%s", path.c_str());
 		if (!p)
 			return "";
 		uint32_t crc = debugLinkCrc32(0, p, sz);
-		free(p);
+		unmap_file(p, sz);
 
-		if (crc != m_debuglinkCrc)
+		if (crc != debuglinkCrc)
 		{
 			kcov_debug(ELF_MSG, "CRC mismatch for debug link %s. Should be 0x%08x, is 0x%08x!\n", path.c_str(),
-					m_debuglinkCrc, crc);
+					debuglinkCrc, crc);
 			return "";
 		}
 
 		return path;
 	}
 
-	std::string lookupDebuglinkFile()
+	std::string lookupDebuglinkFile(const std::string &filename, const std::string &debuglink, uint32_t debuglinkCrc)
 	{
 		std::string filePath;
 		std::string debugPath;
 		char *cpy;
 
-		cpy = ::strdup(m_filename.c_str());
+		cpy = ::strdup(filename.c_str());
 		filePath = std::string(::dirname(cpy));
 		free(cpy);
 
 		// Use debug link from the ELF (same directory as binary)
-		debugPath = tryDebugLink(fmt("%s/%s", filePath.c_str(), m_debuglink.c_str()));
+		debugPath = tryDebugLink(fmt("%s/%s", filePath.c_str(), debuglink.c_str()), debuglinkCrc);
 		if (debugPath != "")
 			return debugPath;
 
 		// Same directory .debug
-		debugPath = tryDebugLink(fmt("%s/.debug/%s", filePath.c_str(), m_debuglink.c_str()));
+		debugPath = tryDebugLink(fmt("%s/.debug/%s", filePath.c_str(), debuglink.c_str()), debuglinkCrc);
 		if (debugPath != "")
 			return debugPath;
 
-		return tryDebugLink(fmt("/usr/lib/debug/%s/%s", get_real_path(filePath).c_str(), m_debuglink.c_str()));
+		return tryDebugLink(fmt("/usr/lib/debug/%s/%s", get_real_path(filePath).c_str(), debuglink.c_str()),
+				debuglinkCrc);
 	}
 
 	// From https://sourceware.org/gdb/onlinedocs/gdb/Separate-Debug-Files.html
@@ -498,23 +1043,36 @@ private:
 
 	SegmentList_t m_curSegments;
 	SegmentList_t m_executableSegments;
+	SegmentIndex m_curSegmentIndex;
+	SegmentIndex m_executableSegmentIndex;
 
 	IDisassembler &m_addressVerifier;
 	bool m_verifyAddresses;
+	bool m_filterUnits;
+	bool m_readFunctions;
+	std::string m_mainPreparseFilename;
+	pthread_t m_mainPreparseThread;
+	bool m_mainPreparsing;
 	IElf *m_elf;
 	bool m_elfIs32Bit;
 	bool m_elfIsShared;
 	LineListenerList_t m_lineListeners;
 	FileListenerList_t m_fileListeners;
+	FunctionListenerList_t m_functionListeners;
+	BasicBlockListenerList_t m_basicBlockListeners;
+	std::unordered_set<uint64_t> m_reportedBasicBlocks;
 	std::string m_filename;
 	std::string m_buildId;
 	std::string m_debuglink;
 	uint32_t m_debuglinkCrc;
+	std::string m_lineCacheDir;
 	bool m_isMainFile;
 	uint64_t m_checksum;
 	bool m_initialized;
 	uint64_t m_relocation;
 	uint32_t m_invalidBreakpoints;
+	PreparsedFileMap_t m_preparsedFiles;
+	std::mutex m_preparsedMutex;
 
 	/***** Add strings to update path information. *******/
 	std::string m_origRoot;
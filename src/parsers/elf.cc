@@ -10,11 +10,13 @@ class ElfImpl : public IElf
 {
 public:
 	ElfImpl(void *data, size_t size) :
-			m_debugLinkValid(false), m_fileData((char *) data), m_fileSize(size)
+			m_debugLinkValid(false), m_fileData((char *) data), m_fileSize(size),
+			m_image(data, [size](const void *p) { unmap_file((void *) p, size); })
 	{
 		parse();
 	}
 
+	// The segments keep the file mapped
 	~ElfImpl()
 	{
 	}
@@ -184,7 +186,7 @@ private:
 			if ((sh_flags & (SHF_EXECINSTR | SHF_ALLOC)) != (SHF_EXECINSTR | SHF_ALLOC))
 				continue;
 
-			Segment seg(m_fileData + sh_offset, sh_addr, sh_addr, sh_size);
+			Segment seg(std::shared_ptr<const void>(m_image, m_fileData + sh_offset), sh_addr, sh_addr, sh_size);
 
 			m_segments.push_back(seg);
 		}
@@ -204,6 +206,7 @@ out_elf_begin:
 
 	char *m_fileData;
 	size_t m_fileSize;
+	std::shared_ptr<const void> m_image;
 };
 
 IElf *IElf::create(const std::string &filename)
@@ -211,8 +214,7 @@ IElf *IElf::create(const std::string &filename)
 	size_t sz;
 	void *data;
 
-	// The data is freed by the parser
-	data = read_file(&sz, "%s", filename.c_str());
+	data = map_file(&sz, "%s", filename.c_str());
 	if (!data)
 		return NULL;
 
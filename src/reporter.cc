@@ -285,102 +285,18 @@ private:
 		if (!m_filter.runFilters(file))
 			return;
 
-		kcov_debug(INFO_MSG, "REPORT %s:%u at 0x%lx\n", file.c_str(), lineNr, (unsigned long) addr);
-
-		File *fp = m_files[file];
-
-		if (!fp)
-		{
-			uint64_t hash = 0;
-
-			/*
-			 * Hash filenames for ELF parsers, the contents otherwise.
-			 *
-			 * Binaries are protected by an ELF checksum, but e.g., bash scripts need
-			 * to be identified by the contents.
-			 */
-			if (!m_hashFilename)
-			{
-				size_t sz;
-				void *data = read_file(&sz, "%s", file.c_str());
-
-				// Compute checksum by contents
-				if (data)
-					hash = hash_block(data, sz);
-
-				free(data);
-			}
-			else
-			{
-				hash = m_fileHash(file);
-			}
-
-			fp = new File(hash);
-
-			// Mark unreachable lines separately (often none)
-			const std::vector<std::string> &lines = ISourceFileCache::getInstance().getLines(file);
-			for (unsigned int nr = 1; nr <= lines.size(); nr++)
-			{
-				if (!m_filter.runLineFilters(file, lineNr, lines[nr - 1]))
-				{
-					Line *line = new Line(fp->getFileHash(), nr, true);
-
-					fp->addLine(nr, line);
-				}
-			}
-
-			m_files[file] = fp;
-		}
-
-		Line *line = fp->getLine(lineNr);
-
-		if (!line)
-		{
-
-			line = new Line(fp->getFileHash(), lineNr);
-			fp->addLine(lineNr, line);
-		}
-
-		uint64_t lineId = line->lineId();
-
-		line->addAddress(addr);
-		bool dup = false;
-		for (LineList_t::iterator it = m_addrToLine[addr].begin();
-			it != m_addrToLine[addr].end();
-			++it)
-		{
-			if (line->lineId() == (*it)->lineId())
-			{
-				dup = true;
-			}
-		}
-		if (!dup)
-		{
-			m_addrToLine[addr].push_back(line);
-		}
-		m_lineIdToFileMap[lineId] = line;
-
-		// Report pending addresses for this file/line
-		PendingFilesMap_t::const_iterator it = m_pendingFiles.find(lineId);
-		if (it != m_pendingFiles.end())
-		{
-			for (PendingHitsList_t::const_iterator fit = it->second.begin(); fit != it->second.end(); ++fit)
-			{
-				const PendingFileAddress &val = *fit;
-				unsigned long hits = val.m_hits;
-				uint64_t index = val.m_index;
-
-				reportAddress(lineId, hits);
+		addLine(file, lookupFile(file), lineNr, addr);
+	}
 
-				line->registerHitIndex(index, hits, m_maxPossibleHits != IFileParser::HITS_UNLIMITED);
-			}
+	void onLines(const std::string &file, const LineAddrList_t &lines)
+	{
+		if (!m_filter.runFilters(file))
+			return;
 
-			// Handled now
-			m_pendingFiles[lineId].clear();
-		}
+		File *fp = lookupFile(file);
 
-		for (ListenerList_t::const_iterator it = m_listeners.begin(); it != m_listeners.end(); ++it)
-			(*it)->onLineReporter(file, lineNr, lineId);
+		for (LineAddrList_t::const_iterator it = lines.begin(); it != lines.end(); ++it)
+			addLine(file, fp, it->first, it->second);
 	}
 
 	// Called when a file is added (e.g., a shared library)
@@ -750,6 +666,111 @@ private:
 	typedef std::vector<PendingFileAddress> PendingHitsList_t; // Address, hits
 	typedef std::unordered_map<uint64_t, PendingHitsList_t> PendingFilesMap_t;
 
+	File *lookupFile(const std::string &file)
+	{
+		File *fp = m_files[file];
+
+		if (!fp)
+		{
+			uint64_t hash = 0;
+
+			/*
+			 * Hash filenames for ELF parsers, the contents otherwise.
+			 *
+			 * Binaries are protected by an ELF checksum, but e.g., bash scripts need
+			 * to be identified by the contents.
+			 */
+			if (!m_hashFilename)
+			{
+				size_t sz;
+				void *data = read_file(&sz, "%s", file.c_str());
+
+				// Compute checksum by contents
+				if (data)
+					hash = hash_block(data, sz);
+
+				free(data);
+			}
+			else
+			{
+				hash = m_fileHash(file);
+			}
+
+			fp = new File(hash);
+
+			// Mark unreachable lines separately (often none)
+			const std::vector<std::string> &lines = ISourceFileCache::getInstance().getLines(file);
+			for (unsigned int nr = 1; nr <= lines.size(); nr++)
+			{
+				if (!m_filter.runLineFilters(file, nr, lines[nr - 1]))
+				{
+					Line *line = new Line(fp->getFileHash(), nr, true);
+
+					fp->addLine(nr, line);
+				}
+			}
+
+			m_files[file] = fp;
+		}
+
+		return fp;
+	}
+
+	void addLine(const std::string &file, File *fp, unsigned int lineNr, uint64_t addr)
+	{
+		kcov_debug(INFO_MSG, "REPORT %s:%u at 0x%lx\n", file.c_str(), lineNr, (unsigned long) addr);
+
+		Line *line = fp->getLine(lineNr);
+
+		if (!line)
+		{
+
+			line = new Line(fp->getFileHash(), lineNr);
+			fp->addLine(lineNr, line);
+		}
+
+		uint64_t lineId = line->lineId();
+
+		line->addAddress(addr);
+		bool dup = false;
+		for (LineList_t::iterator it = m_addrToLine[addr].begin();
+			it != m_addrToLine[addr].end();
+			++it)
+		{
+			if (line->lineId() == (*it)->lineId())
+			{
+				dup = true;
+			}
+		}
+		if (!dup)
+		{
+			m_addrToLine[addr].push_back(line);
+		}
+		m_lineIdToFileMap[lineId] = line;
+
+		// Report pending addresses for this file/line
+		PendingFilesMap_t::const_iterator it = m_pendingFiles.find(lineId);
+		if (it != m_pendingFiles.end())
+		{
+			for (PendingHitsList_t::const_iterator fit = it->second.begin(); fit != it->second.end(); ++fit)
+			{
+				const PendingFileAddress &val = *fit;
+				unsigned long hits = val.m_hits;
+				uint64_t index = val.m_index;
+
+				reportAddress(lineId, hits);
+
+				line->registerHitIndex(index, hits, m_maxPossibleHits != IFileParser::HITS_UNLIMITED);
+			}
+
+			// Handled now
+			m_pendingFiles[lineId].clear();
+		}
+
+		for (ListenerList_t::const_iterator it = m_listeners.begin(); it != m_listeners.end(); ++it)
+			(*it)->onLineReporter(file, lineNr, lineId);
+	}
+
 	FileMap_t m_files;
 	AddrToLineMap_t m_addrToLine;
 	AddrToHitsMap_t m_pendingHits;
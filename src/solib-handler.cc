@@ -4,13 +4,16 @@
 #include <configuration.hh>
 #include <capabilities.hh>
 #include <file-parser.hh>
+#include <elf.hh>
 #include <utils.hh>
 #include <phdr_data.h>
 #include <generated-data-base.hh>
 
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
-#include <vector>
 #include <unordered_map>
+#include <vector>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -31,7 +34,7 @@ class SolibHandler : public ISolibHandler, ICollector::IEventTickListener
 public:
 	SolibHandler(IFileParser &parser, ICollector &collector) :
 			m_ldPreloadString(NULL), m_envString(NULL), m_solibFd(-1), m_solibThreadValid(false), m_threadShouldExit(false),
-			m_parser(&parser), m_hasSetupRelocation(false)
+			m_pauseBudget(0), m_parser(&parser), m_hasSetupRelocation(false)
 	{
 		memset(&m_solibThread, 0, sizeof(m_solibThread));
 
@@ -44,7 +47,10 @@ public:
 	{
 		void *rv;
 
+		m_parseMutex.lock();
 		m_threadShouldExit = true;
+		m_parseMutex.unlock();
+		m_parseQueued.notify_all();
 		if (m_solibPath != "")
 			unlink(m_solibPath.c_str());
 		if (m_solibDirectory != "")
@@ -65,12 +71,20 @@ public:
 			pthread_kill(m_solibThread, SIGTERM);
 			pthread_join(m_solibThread, &rv);
 		}
+
+		for (ThreadList_t::const_iterator it = m_parserThreads.begin(); it != m_parserThreads.end(); ++it)
+			pthread_join(*it, &rv);
 	}
 
 	// From IEventTickListener
 	void onTick()
 	{
-		checkSolibData();
+		checkSolibData(m_pauseBudget);
+	}
+
+	void finish()
+	{
+		checkSolibData(0);
 	}
 
 	void startup()
@@ -81,8 +95,11 @@ public:
 		std::string kcov_solib_pipe_path = IOutputHandler::getInstance().getOutDirectory() + "kcov-solib.pipe";
 		std::string kcov_solib_path = IOutputHandler::getInstance().getBaseDirectory() + "libkcov_sowrapper.so";
 
+		m_wrapperPath = get_real_path(kcov_solib_path);
+
 		// Skip this very special library
 		m_foundSolibs[get_real_path(kcov_solib_path)] = true;
+		m_parsedSolibs[get_real_path(kcov_solib_path)] = true;
 
 		write_file(__library_data.data(), __library_data.size(), "%s", kcov_solib_path.c_str());
 
@@ -131,15 +148,45 @@ public:
 		}
 		putenv(m_envString);
 
+		// In milliseconds, 0 to wait for all solibs to be parsed
+		m_pauseBudget = IConfiguration::getInstance().keyAsInt("pause-budget") * 1000ULL;
+
+		// Started before the engine ties kcov to one CPU, so the parsing runs in parallel
+		long nThreads = std::min(std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L), 16L);
+		for (long i = 0; i < nThreads; i++)
+		{
+			pthread_t thread;
+
+			if (pthread_create(&thread, NULL, SolibHandler::parserThreadStatic, (void *) this) == 0)
+				m_parserThreads.push_back(thread);
+		}
+
 		m_solibPath = kcov_solib_pipe_path;
 		pthread_create(&m_solibThread, NULL, SolibHandler::threadStatic, (void *) this);
+	}
+
+	// Read exactly @a size bytes, since a message can arrive in several pieces
+	bool readMessage(uint8_t *buf, size_t size)
+	{
+		size_t done = 0;
+
+		while (done < size)
+		{
+			ssize_t r = read(m_solibFd, buf + done, size - done);
+
+			// The destructor will close m_solibFd, so we'll exit here in that case
+			if (r <= 0)
+				return false;
+
+			done += r;
+		}
 
+		return true;
 	}
 
 	void solibThreadParse()
 	{
-                auto buf_ = std::vector<uint8_t>(1024 * 1024 * 100);
-		uint8_t* buf = buf_.data();
+		struct phdr_data hdr;
 
 		m_solibFd = ::open(m_solibPath.c_str(), O_RDONLY);
 		m_solibThreadValid = true;
@@ -149,31 +196,46 @@ public:
 
 		while (1)
 		{
-			int r = read(m_solibFd, buf, buf_.size());
-
-			// The destructor will close m_solibFd, so we'll exit here in that case
-			if (r <= 0)
+			if (!readMessage((uint8_t *) &hdr, sizeof(hdr)))
 				break;
 
-			panic_if((unsigned )r >= buf_.size(), "Too much solib data read");
+			// Out of sync with the writer
+			if (!phdr_data_unmarshal(&hdr))
+			{
+				kcov_debug(ENGINE_MSG, "Invalid solib data read\n");
+				break;
+			}
 
-			struct phdr_data *p = phdr_data_unmarshal(buf);
+			// Only the new objects are sent, so read the entries directly into the message
+			size_t sz = sizeof(struct phdr_data) + hdr.n_entries * sizeof(struct phdr_data_entry);
+			struct phdr_data *cpy = (struct phdr_data*) xmalloc(sz);
 
-			if (p)
+			memcpy(cpy, &hdr, sizeof(hdr));
+			if (!readMessage((uint8_t *) cpy->entries, sz - sizeof(hdr)))
 			{
-				size_t sz = sizeof(struct phdr_data) + p->n_entries * sizeof(struct phdr_data_entry);
-				struct phdr_data *cpy = (struct phdr_data*) xmalloc(sz);
+				free(cpy);
+				break;
+			}
 
-				memcpy(cpy, p, sz);
+			kcov_debug(ENGINE_MSG, "solib message %u from %u: %u new objects of %u\n", cpy->seq, cpy->pid,
+					cpy->n_entries, cpy->generation);
 
-				m_phdrListMutex.lock();
-				m_phdrs.push_back(cpy);
-				m_phdrListMutex.unlock();
-			}
-			m_solibDataReadSemaphore.notify();
+			// Start parsing before the trap is taken
+			queueSolibParsing(cpy);
+
+			std::lock_guard<std::mutex> lock(m_phdrListMutex);
+			unsigned int &received = m_receivedMessages[cpy->pid];
+
+			// Restarted in forked children and exec'd programs
+			received = cpy->seq == 1 ? 1 : received + 1;
+			if (received != cpy->seq)
+				kcov_debug(ENGINE_MSG, "solib message %u from %u received as %u\n", cpy->seq, cpy->pid, received);
+
+			m_phdrs.push_back(cpy);
+			m_solibDataRead.notify_all();
 		}
 
-		m_solibDataReadSemaphore.notify();
+		m_solibDataRead.notify_all();
 		close(m_solibFd);
 	}
 
@@ -198,24 +260,229 @@ public:
 		return NULL;
 	}
 
-	void checkSolibData()
+	void queueSolibParsing(const struct phdr_data *p)
+	{
+		// Parsed by the collector thread instead
+		if (m_parserThreads.empty())
+			return;
+
+		std::lock_guard<std::mutex> lock(m_parseMutex);
+
+		for (unsigned int i = 0; i < p->n_entries; i++)
+		{
+			const char *name = p->entries[i].name;
+
+			if (strlen(name) == 0 || m_parsedSolibs.find(name) != m_parsedSolibs.end())
+				continue;
+
+			m_parsedSolibs[name] = false;
+			m_parseQueue.push_back(name);
+		}
+
+		m_parseQueued.notify_all();
+	}
+
+	/*
+	 * Read the solibs and their DWARF data in parallel. The collector thread
+	 * then only has to report the lines, see checkSolibData().
+	 */
+	void parserThreadMain()
+	{
+		std::unique_lock<std::mutex> lock(m_parseMutex);
+
+		while (1)
+		{
+			m_parseQueued.wait(lock, [this] {
+				return m_threadShouldExit || !m_parseQueue.empty();
+			});
+
+			if (m_threadShouldExit)
+				break;
+
+			std::string name = m_parseQueue.front();
+			m_parseQueue.pop_front();
+
+			lock.unlock();
+			m_parser->preparseFile(name);
+			lock.lock();
+
+			m_parsedSolibs[name] = true;
+			m_solibParsed.notify_all();
+		}
+	}
+
+	static void *parserThreadStatic(void *pThis)
+	{
+		SolibHandler *p = (SolibHandler *) pThis;
+
+		p->parserThreadMain();
+
+		return NULL;
+	}
+
+	// Wait until @a name has been read by a parser thread, or until @a deadline
+	bool waitForSolibParsing(const std::string &name, uint64_t deadline)
+	{
+		std::unique_lock<std::mutex> lock(m_parseMutex);
+		ParsedSolibsMap_t::const_iterator it = m_parsedSolibs.find(name);
+
+		// Not queued (exec'd programs are parsed directly)
+		if (it == m_parsedSolibs.end())
+			return true;
+
+		// The map can be rehashed while waiting, but the element stays
+		const bool &done = it->second;
+
+		while (!done)
+		{
+			if (deadline == 0)
+			{
+				m_solibParsed.wait(lock);
+				continue;
+			}
+
+			uint64_t now = get_us_timestamp();
+
+			if (now >= deadline)
+				return false;
+
+			m_solibParsed.wait_for(lock, std::chrono::microseconds(deadline - now));
+		}
+
+		return true;
+	}
+
+	unsigned int waitForSolibData(pid_t pid, unsigned int count)
+	{
+		std::unique_lock<std::mutex> lock(m_phdrListMutex);
+
+		// No reader thread, e.g., for --pid
+		if (m_solibPath == "")
+			return 0;
+
+		// The message is written before the trap, so this is quick. The timeout is for
+		// a reader thread which has gone missing
+		m_solibDataRead.wait_for(lock, std::chrono::seconds(2), [&] {
+			return m_receivedMessages[pid] >= count;
+		});
+
+		if (m_receivedMessages[pid] < count)
+			kcov_debug(ENGINE_MSG, "no solib message %u from %d\n", count, pid);
+
+		return m_receivedMessages[pid];
+	}
+
+	void forgetSolibData(pid_t pid)
 	{
-		struct phdr_data *p = NULL;
+		std::lock_guard<std::mutex> lock(m_phdrListMutex);
+
+		m_receivedMessages.erase(pid);
+		m_wrapperCode.erase(pid);
+	}
+
+	/*
+	 * Is @a addr in the code of the solib wrapper, i.e., is it a trap after a
+	 * message and not one which the program raises itself? The code is looked
+	 * up in /proc/PID/maps the first time, which doesn't block the process.
+	 */
+	bool isSolibTrap(pid_t pid, uint64_t addr)
+	{
+		std::unique_lock<std::mutex> lock(m_phdrListMutex);
+
+		if (m_solibPath == "" || m_wrapperPath == "")
+			return false;
+
+		CodeRangeMap_t::const_iterator it = m_wrapperCode.find(pid);
+
+		if (it == m_wrapperCode.end())
+		{
+			lock.unlock();
+
+			size_t sz;
+			char *maps = (char *) read_file(&sz, "/proc/%d/maps", pid);
+
+			if (!maps)
+				return false;
+
+			std::vector<std::string> lines = split_string(maps, "\n");
+			std::pair<uint64_t, uint64_t> range(0, 0);
+
+			free(maps);
+			for (std::vector<std::string>::const_iterator line = lines.begin(); line != lines.end(); ++line)
+			{
+				unsigned long long start, end;
+				char perms[5];
+				int pathStart = 0;
+
+				if (sscanf(line->c_str(), "%llx-%llx %4s %*s %*s %*s %n", &start, &end, perms, &pathStart) < 3 ||
+						pathStart == 0 || perms[2] != 'x')
+					continue;
+
+				std::string path = line->substr(pathStart);
+
+				// Only resolve the mappings with the name of the wrapper
+				if (path.find(m_wrapperPath.substr(m_wrapperPath.rfind('/') + 1)) == std::string::npos)
+					continue;
+
+				if (get_real_path(path) == m_wrapperPath)
+				{
+					range = std::make_pair((uint64_t) start, (uint64_t) end);
+					break;
+				}
+			}
+
+			lock.lock();
 
+			// Not loaded yet (or not at all), so look again next time
+			if (range.second == 0)
+				return false;
+
+			it = m_wrapperCode.insert(CodeRangeMap_t::value_type(pid, range)).first;
+		}
+
+		return addr >= it->second.first && addr < it->second.second;
+	}
+
+	/*
+	 * The traps of all messages have been taken, so report them now. With
+	 * --pause-budget, solibs which are still being read are left for a later
+	 * tick, so that the program isn't stopped for longer than that.
+	 */
+	void checkSolibData(uint64_t budget)
+	{
 		if (!m_parser)
 			return;
 
-		m_phdrListMutex.lock();
-		if (!m_phdrs.empty())
+		uint64_t deadline = budget == 0 ? 0 : get_us_timestamp() + budget;
+
+		while (1)
 		{
-			p = m_phdrs.front();
+			struct phdr_data *p = NULL;
+
+			m_phdrListMutex.lock();
+			if (!m_phdrs.empty())
+				p = m_phdrs.front();
+			m_phdrListMutex.unlock();
+
+			if (!p)
+				break;
+
+			if (!parseSolibData(p, deadline))
+			{
+				kcov_debug(ENGINE_MSG, "solib message %u from %u still being parsed\n", p->seq, p->pid);
+				break;
+			}
+
+			m_phdrListMutex.lock();
 			m_phdrs.pop_front();
-		}
-		m_phdrListMutex.unlock();
+			m_phdrListMutex.unlock();
 
-		if (!p)
-			return;
+			free(p);
+		}
+	}
 
+	bool parseSolibData(struct phdr_data *p, uint64_t deadline)
+	{
 		// Setup where the main file is relocated once (for PIEs)
 		if (!m_hasSetupRelocation)
 		{
@@ -233,33 +500,101 @@ public:
 			if (m_foundSolibs.find(cur->name) != m_foundSolibs.end())
 				continue;
 
+			if (!waitForSolibParsing(cur->name, deadline))
+				return false;
+
 			m_parser->addFile(cur->name, cur);
 			m_parser->parse();
 
 			m_foundSolibs[cur->name] = true;
 		}
 
-		free(p);
+		return true;
+	}
+
+	std::string execImageId(const struct phdr_data_entry *image)
+	{
+		struct stat st;
+
+		if (stat(image->name, &st) < 0)
+			return "";
+
+		std::string file = fmt("%llx:%llx:%llx", (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+				(unsigned long long) st.st_mtime);
+		ExecFileMap_t::iterator it = m_execFiles.find(file);
+
+		// Only read the file the first time it's exec'd
+		if (it == m_execFiles.end())
+		{
+			IElf *elf = IElf::create(image->name);
+			std::string buildId;
+
+			if (elf)
+			{
+				buildId = elf->getBuildId();
+				delete elf;
+			}
+
+			// Without a build-id, the file itself identifies the image
+			if (buildId == "")
+				buildId = file;
+
+			it = m_execFiles.insert(std::make_pair(file, buildId)).first;
+		}
+
+		// Without ASLR, the same image is loaded at the same address each time
+		unsigned long base = image->n_segments > 0 ? image->segments[0].vaddr : 0;
+
+		return fmt("%s@%lx", it->second.c_str(), base);
+	}
+
+	void parseExecImage(struct phdr_data_entry *image)
+	{
+		if (!m_parser || m_parser->getParserType() != "ELF")
+			return;
+
+		kcov_debug(INFO_MSG, "parsing exec'd %s\n", image->name);
+
+		m_parser->addFile(image->name, image);
+		m_parser->parse();
 	}
 
 //private:
 
 	typedef std::list<struct phdr_data *> PhdrList_t;
 	typedef std::unordered_map<std::string, bool> FoundSolibsMap_t;
+	typedef std::unordered_map<std::string, std::string> ExecFileMap_t; // dev:inode:mtime -> build-id
+	typedef std::unordered_map<pid_t, unsigned int> MessageCountMap_t;
+	typedef std::unordered_map<pid_t, std::pair<uint64_t, uint64_t> > CodeRangeMap_t;
+	typedef std::unordered_map<std::string, bool> ParsedSolibsMap_t; // Name -> done
+	typedef std::list<std::string> ParseQueue_t;
+	typedef std::vector<pthread_t> ThreadList_t;
 
 	std::string m_solibPath;
 	std::string m_solibDirectory;
+	std::string m_wrapperPath;
+	CodeRangeMap_t m_wrapperCode; // Executable mapping of the wrapper, per process
 	char *m_ldPreloadString;
 	char *m_envString;
 	int m_solibFd;
 	bool m_solibThreadValid;
 	bool m_threadShouldExit;
 	pthread_t m_solibThread;
-	Semaphore m_solibDataReadSemaphore;
+	std::condition_variable m_solibDataRead;
+	MessageCountMap_t m_receivedMessages;
 	PhdrList_t m_phdrs;
 	FoundSolibsMap_t m_foundSolibs;
+	ExecFileMap_t m_execFiles;
 	std::mutex m_phdrListMutex;
 
+	ThreadList_t m_parserThreads;
+	ParseQueue_t m_parseQueue;
+	ParsedSolibsMap_t m_parsedSolibs;
+	std::condition_variable m_parseQueued;
+	std::condition_variable m_solibParsed;
+	std::mutex m_parseMutex;
+	uint64_t m_pauseBudget; // us
+
 	IFileParser *m_parser;
 	bool m_hasSetupRelocation;
 };
@@ -273,9 +608,48 @@ ISolibHandler &kcov::createSolibHandler(IFileParser &parser, ICollector &collect
 	return *g_handler;
 }
 
-void kcov::blockUntilSolibDataRead()
+unsigned int kcov::waitForSolibData(pid_t pid, unsigned int count)
+{
+	if (!g_handler)
+		return 0;
+
+	return g_handler->waitForSolibData(pid, count);
+}
+
+bool kcov::isSolibTrap(pid_t pid, uint64_t addr)
+{
+	if (!g_handler)
+		return false;
+
+	return g_handler->isSolibTrap(pid, addr);
+}
+
+void kcov::forgetSolibData(pid_t pid)
+{
+	if (g_handler)
+		g_handler->forgetSolibData(pid);
+}
+
+bool kcov::solibDataPending()
+{
+	if (!g_handler)
+		return false;
+
+	std::lock_guard<std::mutex> lock(g_handler->m_phdrListMutex);
+
+	return !g_handler->m_phdrs.empty();
+}
+
+std::string kcov::execImageId(const struct phdr_data_entry *image)
+{
+	if (!g_handler)
+		return "";
+
+	return g_handler->execImageId(image);
+}
+
+void kcov::parseExecImage(struct phdr_data_entry *image)
 {
-	// If it has been started
-	if (g_handler->m_solibThreadValid)
-		g_handler->m_solibDataReadSemaphore.wait();
+	if (g_handler)
+		g_handler->parseExecImage(image);
 }
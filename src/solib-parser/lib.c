@@ -12,21 +12,104 @@
 #include <unistd.h>
 #include <link.h>
 #include <dlfcn.h>
+#include <sched.h>
 
 #include <phdr_data.h>
 
 static struct phdr_data *phdr_data;
 
+/*
+ * Messages are numbered per process, and each is followed by one trap. kcov
+ * waits for the message of a trap before it lets the process continue.
+ */
+static pid_t seq_pid;
+static uint32_t seq;
+
+/*
+ * Only objects which haven't been sent before are sent, since kcov parses each
+ * object once. Objects are identified by load address and name. When objects
+ * have been unloaded (dlpi_subs has changed), everything is sent again, so
+ * that an object which is loaded where an unloaded one was is sent as well.
+ */
+#define N_SENT_OBJECTS 4096
+struct sent_object
+{
+	unsigned long addr;
+	char *name; // NULL for unused slots
+};
+static struct sent_object sent_objects[N_SENT_OBJECTS];
+static unsigned int n_sent_objects;
+static unsigned long long sent_subs;
+
+// The process which is sending a message, one thread at a time
+static pid_t lock_owner;
+
+static void forget_sent(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_SENT_OBJECTS; i++)
+		free(sent_objects[i].name);
+	memset(sent_objects, 0, sizeof(sent_objects));
+	n_sent_objects = 0;
+}
+
+/* Returns 1 if the object is new, and remembers it */
+static int mark_sent(struct dl_phdr_info *info)
+{
+	const char *name = info->dlpi_name ? info->dlpi_name : "";
+	unsigned long hash = info->dlpi_addr;
+	const char *p;
+	unsigned int i;
+
+	// Only picks the slot, the address and name are compared below
+	for (p = name; *p; p++)
+		hash = hash * 31 + (unsigned char)*p;
+
+	// Full, so just send it again (kcov skips it)
+	if (n_sent_objects >= N_SENT_OBJECTS / 4 * 3)
+		return 1;
+
+	for (i = hash % N_SENT_OBJECTS;; i = (i + 1) % N_SENT_OBJECTS)
+	{
+		struct sent_object *cur = &sent_objects[i];
+
+		if (!cur->name)
+		{
+			cur->name = strdup(name);
+			if (!cur->name)
+				return 1;
+			cur->addr = info->dlpi_addr;
+			n_sent_objects++;
+
+			return 1;
+		}
+
+		if (cur->addr == info->dlpi_addr && strcmp(cur->name, name) == 0)
+			return 0;
+	}
+}
+
 static int phdrCallback(struct dl_phdr_info *info, size_t size, void *data)
 {
 	// the first entry is used to determine the executable's "base address"
 	// (which is actually the relocation for PIE)
-	if (phdr_data->n_entries == 0)
+	if (*(int *)data)
 	{
+		*(int *)data = 0;
 		phdr_data->relocation = info->dlpi_addr;
+		phdr_data->generation = info->dlpi_adds;
+
+		// Something was dlclose()d, and its address might be reused
+		if (info->dlpi_subs != sent_subs)
+		{
+			forget_sent();
+			sent_subs = info->dlpi_subs;
+		}
 	}
 
-	phdr_data_add(phdr_data, info);
+	if (mark_sent(info))
+		phdr_data_add(phdr_data, info);
 
 	return 0;
 }
@@ -40,18 +123,69 @@ static int phdrSizeCallback(struct dl_phdr_info *info, size_t size, void *data)
 	return 0;
 }
 
-static void parse_solibs(void)
+static void lock_solibs(void)
+{
+	pid_t me = getpid();
+
+	while (1)
+	{
+		pid_t cur = lock_owner;
+
+		// Not held by a thread in this process, but maybe by the parent before fork
+		if (cur != me && __sync_bool_compare_and_swap(&lock_owner, cur, me))
+		{
+			// ... and then the parent's message might be half-done, so send everything
+			if (cur != 0)
+				forget_sent();
+			return;
+		}
+
+		sched_yield();
+	}
+}
+
+static void unlock_solibs(void)
+{
+	__sync_lock_release(&lock_owner);
+}
+
+/* Returns 1 if the message has been written */
+static int parse_solibs(void)
 {
 	char *kcov_solib_path;
 	void *p;
 	ssize_t written;
 	size_t allocSize;
 	size_t sz;
+	int first;
+	struct flock lock;
 	int fd;
 
 	kcov_solib_path = getenv("KCOV_SOLIB_PATH");
 	if (!kcov_solib_path)
-		return;
+		return 0;
+
+	/*
+	 * The messages are larger than PIPE_BUF, so writes from other threads and
+	 * processes would be interleaved. Record locks are per process, and not
+	 * inherited by fork, so threads are serialized separately (which also
+	 * protects phdr_data).
+	 */
+	lock_solibs();
+
+	fd = open(kcov_solib_path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "kcov-solib: Can't open %s\n", kcov_solib_path);
+		unlock_solibs();
+		return 0;
+	}
+
+	lock.l_type = F_WRLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = 0;
+	lock.l_len = 0;
+	fcntl(fd, F_SETLKW, &lock);
 
 	allocSize = sizeof(struct phdr_data);
 	dl_iterate_phdr(phdrSizeCallback, &allocSize);
@@ -60,20 +194,26 @@ static void parse_solibs(void)
 	if (!phdr_data)
 	{
 		fprintf(stderr, "kcov-solib: Can't allocate %zu bytes\n", allocSize);
-		return;
+		close(fd);
+		unlock_solibs();
+		return 0;
 	}
 
 
-	dl_iterate_phdr(phdrCallback, NULL);
-
-	p = phdr_data_marshal(phdr_data, &sz);
+	first = 1;
+	dl_iterate_phdr(phdrCallback, &first);
 
-	fd = open(kcov_solib_path, O_WRONLY);
-	if (fd < 0)
+	// Restart the numbering in forked children
+	if (seq_pid != getpid())
 	{
-		fprintf(stderr, "kcov-solib: Can't open %s\n", kcov_solib_path);
-		return;
+		seq_pid = getpid();
+		seq = 0;
 	}
+	phdr_data->pid = seq_pid;
+	phdr_data->seq = ++seq;
+
+	p = phdr_data_marshal(phdr_data, &sz);
+
 	written = write(fd, p, sz);
 
 	if (written != sz)
@@ -81,7 +221,39 @@ static void parse_solibs(void)
 
 	phdr_data_free(p);
 
+	// Also releases the record lock
 	close(fd);
+	unlock_solibs();
+
+	return written == sz;
+}
+
+/*
+ * kcov can detach from processes where all breakpoints have been hit (see
+ * --auto-detach). These, and their children, must not report solibs or trap.
+ */
+static int is_traced(void)
+{
+	char buf[4096];
+	char *p;
+	ssize_t r;
+	int fd;
+
+	fd = open("/proc/self/status", O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return 1;
+	buf[r] = '\0';
+
+	p = strstr(buf, "TracerPid:");
+	if (!p)
+		return 1;
+
+	return atoi(p + strlen("TracerPid:")) != 0;
 }
 
 static void force_breakpoint(void)
@@ -117,8 +289,11 @@ void *dlopen(const char *filename, int flag)
 
 	out = orig_dlopen(filename, flag);
 
-	parse_solibs();
-	force_breakpoint();
+	if (!is_traced())
+		return out;
+
+	if (parse_solibs())
+		force_breakpoint();
 
 	return out;
 }
@@ -126,6 +301,9 @@ void *dlopen(const char *filename, int flag)
 
 void  __attribute__((constructor))kcov_solib_at_startup(void)
 {
-	parse_solibs();
-	force_breakpoint();
+	if (!is_traced())
+		return;
+
+	if (parse_solibs())
+		force_breakpoint();
 }
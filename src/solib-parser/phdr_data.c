@@ -10,7 +10,7 @@
 #include <link.h>
 
 #define KCOV_MAGIC         0x6b636f76 /* "kcov" */
-#define KCOV_SOLIB_VERSION 3
+#define KCOV_SOLIB_VERSION 5
 
 // Add symbols missing from FreeBSD's elfutils
 #ifndef __ELF_NATIVE_CLASS
@@ -38,6 +38,9 @@ struct phdr_data *phdr_data_new(size_t allocSize)
 
 	p->magic = KCOV_MAGIC;
 	p->version = KCOV_SOLIB_VERSION;
+	p->pid = 0;
+	p->seq = 0;
+	p->generation = 0;
 	p->relocation = 0;
 	p->n_entries = 0;
 
@@ -39,29 +39,20 @@ private:
 	{
 	public:
 		File() :
-			m_data(NULL),
-			m_dataSize(0),
 			m_crc(0)
 		{
 		}
 
-		~File()
+		// Only the lines and CRC are kept, not the data itself
+		File(const uint8_t *data, size_t size)
 		{
-			free((void*)m_data);
-		}
-
-		File(const uint8_t *data, size_t size) :
-			m_data(data), m_dataSize(size)
-		{
-			std::string fileData((const char*)m_data, size);
+			std::string fileData((const char*)data, size);
 
 			m_crc = hash_block(data, size);
 
 			m_lines = split_string(fileData, "\n");
 		}
 
-		const uint8_t *m_data;
-		size_t m_dataSize;
 		std::vector<std::string> m_lines;
 		uint32_t m_crc;
 	};
@@ -84,9 +75,12 @@ private:
 		size_t sz;
 		uint8_t *p = (uint8_t *)read_file(&sz, "%s", filePath.c_str());
 
-		// Can read?
+		// Can read? The lines are copies, so the data isn't kept
 		if (p)
+		{
 			m_files[filePath] = new File(p, sz);
+			free(p);
+		}
 		else // Unreadable, populate with empty
 			m_files[filePath] = &m_empty;
 
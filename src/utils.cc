@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -20,6 +21,7 @@
 #include <stdexcept>
 #include <algorithm>
 #include <unordered_map>
+#include <mutex>
 
 #include <curl/curl.h>
 
@@ -41,6 +43,39 @@ void msleep(uint64_t ms)
 	nanosleep(&ts, NULL);
 }
 
+static void *read_regular_file(size_t *out_size, int fd, size_t size)
+{
+	// One byte extra, zeroed, to terminate text files
+	uint8_t *data = (uint8_t *)xmalloc(size + 1);
+	size_t pos = 0;
+
+	while (pos < size)
+	{
+		ssize_t n = read(fd, data + pos, size - pos);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			close(fd);
+			free(data);
+
+			return NULL;
+		}
+		// Truncated since fstat
+		if (n == 0)
+			break;
+
+		pos += n;
+	}
+
+	*out_size = pos;
+
+	close(fd);
+
+	return data;
+}
+
 static void *read_file_int(size_t *out_size, uint64_t timeout, const char *path)
 {
 	uint8_t *data = NULL;
@@ -66,6 +101,11 @@ static void *read_file_int(size_t *out_size, uint64_t timeout, const char *path)
 	if (fd < 0)
 		return NULL;
 
+	// The size of regular files is known, so read them in one go
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		return read_regular_file(out_size, fd, st.st_size);
+
 	tv.tv_sec = timeout / 1000;
 	tv.tv_usec = (timeout % 1000) * 10;
 
@@ -128,6 +168,73 @@ void *read_file(size_t *out_size, const char *fmt, ...)
 	return read_file_int(out_size, 0, path);
 }
 
+void *map_file(size_t *out_size, const char *fmt, ...)
+{
+	char path[2048];
+	va_list ap;
+	int r;
+
+	/* Create the filename */
+	va_start(ap, fmt);
+	r = vsnprintf(path, 2048, fmt, ap);
+	va_end(ap);
+
+	panic_if (r >= 2048,
+			"Too long string!");
+
+	struct stat st;
+	void *data;
+
+	if (!mocked_read_callback && stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		int fd = open(path, O_RDONLY);
+
+		if (fd < 0)
+			return NULL;
+
+		// Private, so that the data can be modified in place (e.g., byte-swapped)
+		data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (data == MAP_FAILED)
+			return NULL;
+
+		*out_size = st.st_size;
+
+		return data;
+	}
+
+	// FIFOs, empty and /proc files: read and place in anonymous memory
+	size_t size;
+	void *p = read_file_int(&size, 0, path);
+
+	if (!p)
+		return NULL;
+
+	data = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+	{
+		free(p);
+
+		return NULL;
+	}
+
+	memcpy(data, p, size);
+	free(p);
+
+	*out_size = size;
+
+	return data;
+}
+
+void unmap_file(void *data, size_t size)
+{
+	if (!data)
+		return;
+
+	munmap(data, size ? size : 1);
+}
+
 void *peek_file(size_t *out_size, const char *fmt, ...)
 {
 	char path[2048];
@@ -305,12 +412,14 @@ bool file_readable(FILE *fp, unsigned int ms)
 }
 
 static std::unordered_map<std::string, bool> statCache;
+static std::mutex statCacheMutex; // Also used by the solib parser threads
 
 bool file_exists(const std::string &path)
 {
 	if (mocked_file_exists_callback)
 		return mocked_file_exists_callback(path);
 
+	std::lock_guard<std::mutex> lock(statCacheMutex);
 	bool out;
 
 	if (statCache.find(path) == statCache.end())
@@ -498,6 +607,15 @@ uint64_t get_ms_timestamp(void)
 	return ((tv.tv_sec * 1000000ULL + tv.tv_usec) / 1000) - first;
 }
 
+uint64_t get_us_timestamp(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 bool machine_is_64bit(void)
 {
 	return sizeof(unsigned long) == 8;
@@ -576,8 +694,10 @@ std::string trim_string(const std::string &strIn, const std::string &trimEndChar
 // Cache for ::realpath - it's apparently one of the reasons why kcov is slow
 typedef std::unordered_map<std::string, std::string> PathMap_t;
 static PathMap_t realPathCache;
+static std::mutex realPathCacheMutex; // Entries are never removed, so the returned reference stays valid
 const std::string &get_real_path(const std::string &path)
 {
+	std::lock_guard<std::mutex> lock(realPathCacheMutex);
 	PathMap_t::const_iterator it = realPathCache.find(path);
 	if (it != realPathCache.end())
 		return it->second;
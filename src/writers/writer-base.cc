@@ -100,6 +100,13 @@ void WriterBase::onLine(const std::string &file, unsigned int lineNr, uint64_t a
 	m_files[file] = new File(file);
 }
 
+void WriterBase::onLines(const std::string &file, const LineAddrList_t &lines)
+{
+	// Only the file is of interest
+	if (!lines.empty())
+		onLine(file, lines.front().first, lines.front().second);
+}
+
 void *WriterBase::marshalSummary(IReporter::ExecutionSummary &summary, const std::string &name, size_t *sz)
 {
 	struct summaryStruct *p;
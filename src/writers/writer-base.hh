@@ -46,6 +46,8 @@ namespace kcov
 		/* Called when the ELF is parsed */
 		void onLine(const std::string &file, unsigned int lineNr, uint64_t addr);
 
+		void onLines(const std::string &file, const LineAddrList_t &lines);
+
 
 		void *marshalSummary(IReporter::ExecutionSummary &summary,
 				const std::string &name, size_t *sz);
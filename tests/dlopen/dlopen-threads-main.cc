@@ -0,0 +1,47 @@
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char g_path[PATH_MAX];
+
+static void *thread(void *arg)
+{
+	for (int i = 0; i < 10; i++)
+	{
+		// Each dlopen sends the solib list to kcov
+		void *handle = dlopen(g_path, RTLD_LAZY);
+		int (*sym)(int);
+
+		if (!handle)
+			exit(1);
+
+		sym = (int (*)(int))dlsym(handle, "vobb");
+		if (!sym)
+			exit(1);
+
+		sym(5);
+		dlclose(handle);
+	}
+
+	return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+	pthread_t threads[4];
+	const char *slash = strrchr(argv[0], '/');
+
+	// The library is built next to the program
+	snprintf(g_path, sizeof(g_path), "%.*slibshared_library.so",
+			slash ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, thread, NULL);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
@@ -56,3 +56,15 @@ def hitsPerLine(dom, fileName, lineNr):
             return hits
 
     return None
+
+
+def hitsPerFile(dom, fileName):
+    fileName = fileName.replace(".", "_").replace("-", "_")
+    fileTag = lookupClassName(dom, fileName)
+    out = {}
+
+    if fileTag is not None:
+        for tag in fileTag.getElementsByTagName("line"):
+            out[int(tag.attributes["number"].value)] = int(tag.attributes["hits"].value)
+
+    return out
@@ -1,5 +1,7 @@
 import os
 import platform
+import signal
+import subprocess
 import sys
 import time
 import unittest
@@ -72,6 +74,96 @@ class vfork(libkcov.TestCase):
         assert cobertura.hitsPerLine(dom, "vfork.c", 18) >= 1
 
 
+class fork_exec(libkcov.TestCase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        rv, o = self.do(
+            self.kcov + " " + self.outbase + "/kcov " + self.binaries + "/fork+exec " + self.binaries + "/pie",
+            False,
+        )
+        assert rv == 0
+
+        # The exec'd program is parsed when the child execs it
+        dom = cobertura.parseFile(self.outbase + "/kcov/fork+exec/cobertura.xml")
+        assert cobertura.hitsPerLine(dom, "fork+exec.c", 25) >= 1
+        assert cobertura.hitsPerLine(dom, "pie.c", 5) == 1
+
+
+class OptionBase(libkcov.TestCase):
+    # The options shouldn't change the report, so compare with a run without them
+    def doTest(self, options, binary, files):
+        noKcovRv, o = self.doCmd(self.binaries + "/" + binary)
+        rv, o = self.do(
+            self.kcov + " " + self.outbase + "/kcov/default " + self.binaries + "/" + binary,
+            False,
+        )
+        assert rv == noKcovRv
+
+        rv, o = self.do(
+            self.kcov + " " + options + " " + self.outbase + "/kcov/options " + self.binaries + "/" + binary,
+            False,
+        )
+        assert rv == noKcovRv
+
+        default = cobertura.parseFile(self.outbase + "/kcov/default/" + binary + "/cobertura.xml")
+        dom = cobertura.parseFile(self.outbase + "/kcov/options/" + binary + "/cobertura.xml")
+        for file in files:
+            hits = cobertura.hitsPerFile(default, file)
+
+            assert len(hits) > 0
+            assert cobertura.hitsPerFile(dom, file) == hits
+
+
+class multi_core(OptionBase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        self.doTest("--multi-core", "fork", ["fork.c"])
+        self.doTest("--multi-core", "dlopen-threads", ["dlopen-threads-main.cc"])
+
+
+class tracer_threads(OptionBase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        self.doTest("--tracer-threads", "fork", ["fork.c"])
+        self.doTest("--tracer-threads --multi-core", "dlopen-threads", ["dlopen-threads-main.cc"])
+
+
+class lazy_breakpoints(OptionBase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        self.doTest("--lazy-breakpoints", "pie-test", ["argv-dependent.c"])
+        self.doTest("--lazy-breakpoints", "dlopen-threads", ["dlopen-threads-main.cc"])
+
+        # mibb() is called in three processes, all forked before any of them called it
+        self.doTest("--lazy-breakpoints", "fork", ["fork.c"])
+
+
+class basic_block_breakpoints(OptionBase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    @unittest.skipUnless(platform.machine() in ["x86_64", "i686", "i386"], "Only for x86")
+    def runTest(self):
+        self.doTest("--basic-block-breakpoints", "pie-test", ["argv-dependent.c"])
+        self.doTest("--basic-block-breakpoints", "fork", ["fork.c"])
+        self.doTest("--basic-block-breakpoints", "dlopen-threads", ["dlopen-threads-main.cc"])
+
+
+class pause_budget(OptionBase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        # Long enough for all breakpoints, so that nothing runs before they are set
+        self.doTest("--pause-budget=1000", "fork", ["fork.c"])
+        self.doTest("--pause-budget=1000", "dlopen-threads", ["dlopen-threads-main.cc"])
+
+
+class auto_detach(OptionBase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        # All lines of pie.c are hit, so it's detached from before it exits
+        self.doTest("--auto-detach", "pie", ["pie.c"])
+        self.doTest("--auto-detach", "fork", ["fork.c"])
+        self.doTest("--auto-detach --multi-core", "dlopen-threads", ["dlopen-threads-main.cc"])
+
+
 class popen_test(libkcov.TestCase):
     @unittest.skipUnless(platform.machine() in ["x86_64", "i686", "i386"], "Only for x86")
     def runTest(self):
@@ -142,6 +234,38 @@ class pie_accumulate(libkcov.TestCase):
         assert cobertura.hitsPerLine(dom, "argv-dependent.c", 11) == 1
 
 
+class split_dwarf(libkcov.TestCase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        # --verify reads the functions from the .dwo file
+        rv, o = self.do(
+            self.kcov + " --verify " + self.outbase + "/kcov " + self.binaries + "/split-dwarf",
+            False,
+        )
+        assert rv == 0
+
+        dom = cobertura.parseFile(self.outbase + "/kcov/split-dwarf/cobertura.xml")
+        assert cobertura.hitsPerLine(dom, "argv-dependent.c", 5) == 1
+        assert cobertura.hitsPerLine(dom, "argv-dependent.c", 11) == 0
+
+        # Lines are only deferred to the entry of functions kcov knows about
+        rv, o = self.do(
+            self.kcov
+            + " --lazy-breakpoints --debug=8 "
+            + self.outbase
+            + "/kcov/lazy "
+            + self.binaries
+            + "/split-dwarf",
+            False,
+        )
+        assert rv == 0
+        assert b"deferred until" in o
+
+        dom = cobertura.parseFile(self.outbase + "/kcov/lazy/split-dwarf/cobertura.xml")
+        assert cobertura.hitsPerLine(dom, "argv-dependent.c", 5) == 1
+        assert cobertura.hitsPerLine(dom, "argv-dependent.c", 11) == 0
+
+
 class daemon_wait_for_last_child(libkcov.TestCase):
     @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX, Issue #158")
     @unittest.skipUnless(platform.machine() in ["x86_64", "i686", "i386"], "Only for x86")
@@ -336,6 +460,39 @@ class attach_process_with_threads_creates_threads(libkcov.TestCase):
         assert cobertura.hitsPerLine(dom, "thread-main.c", 9) >= 1
 
 
+class attach_process_job_control_stop(libkcov.TestCase):
+    def processState(self, pid):
+        with open("/proc/%d/stat" % pid) as f:
+            return f.read().rsplit(")", 1)[1].split()[0]
+
+    @unittest.skipUnless(sys.platform.startswith("linux"), "Only for Linux")
+    def runTest(self):
+        prg = subprocess.Popen([self.binaries + "/thread-test"], stdout=subprocess.DEVNULL)
+        time.sleep(0.5)
+        kcov = subprocess.Popen(
+            [self.kcov, "--pid=%d" % prg.pid, self.outbase + "/kcov", self.binaries + "/thread-test"],
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+        )
+        time.sleep(1)
+
+        # Stopped like with Ctrl-Z, the traced program stays stopped until it's continued
+        os.kill(prg.pid, signal.SIGSTOP)
+        time.sleep(0.5)
+        try:
+            for i in range(5):
+                assert self.processState(prg.pid) in ["T", "t"]
+                time.sleep(0.1)
+        finally:
+            os.kill(prg.pid, signal.SIGCONT)
+
+        assert prg.wait(timeout=60) == 0
+        kcov.wait(timeout=60)
+
+        dom = cobertura.parseFile(self.outbase + "/kcov/thread-test/cobertura.xml")
+        assert cobertura.hitsPerLine(dom, "thread-main.c", 9) >= 1
+
+
 class merge_same_file_in_multiple_binaries(libkcov.TestCase):
     def runTest(self):
         rv, o = self.do(
@@ -513,6 +670,23 @@ class dlopen(libkcov.TestCase):
         assert cobertura.hitsPerLine(dom, "solib.c", 15) == 0
 
 
+class dlopen_threads(libkcov.TestCase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX")
+    def runTest(self):
+        noKcovRv, o = self.doCmd(self.binaries + "/dlopen-threads")
+        rv, o = self.do(
+            self.kcov + " " + self.outbase + "/kcov " + self.binaries + "/dlopen-threads",
+            False,
+        )
+
+        assert noKcovRv == rv
+        dom = cobertura.parseFile(self.outbase + "/kcov/dlopen-threads/cobertura.xml")
+        assert cobertura.hitsPerLine(dom, "dlopen-threads-main.cc", 15) >= 1
+        assert cobertura.hitsPerLine(dom, "dlopen-threads-main.cc", 46) == 1
+        assert cobertura.hitsPerLine(dom, "solib.c", 5) >= 1
+        assert cobertura.hitsPerLine(dom, "solib.c", 15) == 0
+
+
 class dlopen_in_ignored_source_file(libkcov.TestCase):
     @unittest.expectedFailure
     def runTest(self):
@@ -1,3 +1,4 @@
+import os
 import sys
 import unittest
 
@@ -23,6 +24,31 @@ class shared_library(libkcov.TestCase):
         assert cobertura.hitsPerLine(dom, "solib.c", 5) == 1
 
 
+class shared_library_line_cache(libkcov.TestCase):
+    @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX, Issue #157")
+    def runTest(self):
+        # The second run reads the lines from the cache
+        for i in range(2):
+            rv, o = self.do(
+                self.kcov
+                + " --clean --line-cache="
+                + self.outbase
+                + "/line-cache "
+                + self.outbase
+                + "/kcov "
+                + self.binaries
+                + "/shared_library_test",
+                False,
+            )
+            assert rv == 0
+
+            dom = cobertura.parseFile(self.outbase + "/kcov/shared_library_test/cobertura.xml")
+            assert cobertura.hitsPerLine(dom, "main.c", 9) >= 1
+            assert cobertura.hitsPerLine(dom, "solib.c", 5) == 1
+
+        assert any(f.endswith(".lines") for f in os.listdir(self.outbase + "/line-cache"))
+
+
 class shared_library_skip(libkcov.TestCase):
     @unittest.skipIf(sys.platform.startswith("darwin"), "Not for OSX, Issue #157")
     def runTest(self):
@@ -0,0 +1,109 @@
+#include "test.hh"
+
+#include <breakpoint-table.hh>
+
+#include <algorithm>
+
+using namespace kcov;
+
+TESTSUITE(breakpoint_table)
+{
+	TEST(emptyTable)
+	{
+		BreakpointTable table;
+
+		ASSERT_TRUE(table.empty());
+		ASSERT_TRUE(table.size() == 0U);
+		ASSERT_TRUE(!table.contains(0x1000));
+		ASSERT_TRUE(table.lookup(0x1000) == NULL);
+	}
+
+	TEST(insertAndLookup)
+	{
+		BreakpointTable table;
+
+		table[0x1000] = 0x90;
+		table[0x1001] = 0xcc;
+
+		ASSERT_TRUE(table.size() == 2U);
+		ASSERT_TRUE(table.contains(0x1000));
+		ASSERT_TRUE(table.contains(0x1001));
+		ASSERT_TRUE(!table.contains(0x1002));
+		ASSERT_TRUE(*table.lookup(0x1000) == 0x90);
+		ASSERT_TRUE(*table.lookup(0x1001) == 0xcc);
+
+		// Existing entry, not a new one
+		table[0x1000] = 0x91;
+		ASSERT_TRUE(table.size() == 2U);
+		ASSERT_TRUE(*table.lookup(0x1000) == 0x91);
+
+		// Inserted with value 0
+		ASSERT_TRUE(table[0x2000] == 0);
+		ASSERT_TRUE(table.size() == 3U);
+	}
+
+	TEST(growAndReserve)
+	{
+		BreakpointTable table;
+		unsigned long n = 100000;
+
+		table.reserve(n);
+		size_t reserved = table.memoryUsage();
+
+		for (unsigned long i = 1; i <= n; i++)
+			table[0x400000 + i * 3] = i;
+
+		// Everything fit without growing the table
+		ASSERT_TRUE(table.memoryUsage() == reserved);
+		ASSERT_TRUE(table.size() == n);
+
+		// Grows past the reserved size
+		for (unsigned long i = n + 1; i <= n * 2; i++)
+			table[0x400000 + i * 3] = i;
+
+		ASSERT_TRUE(table.memoryUsage() > reserved);
+		ASSERT_TRUE(table.size() == n * 2);
+
+		for (unsigned long i = 1; i <= n * 2; i++)
+		{
+			const unsigned long *p = table.lookup(0x400000 + i * 3);
+
+			ASSERT_TRUE(p);
+			ASSERT_TRUE(*p == i);
+			ASSERT_TRUE(!table.contains(0x400000 + i * 3 + 1));
+		}
+	}
+
+	TEST(addresses)
+	{
+		BreakpointTable table;
+
+		ASSERT_TRUE(table.addresses().empty());
+
+		table[0x3000] = 3;
+		table[0x1000] = 1;
+		table[0x2000] = 2;
+
+		std::vector<unsigned long> addresses = table.addresses();
+
+		std::sort(addresses.begin(), addresses.end());
+		ASSERT_TRUE(addresses.size() == 3U);
+		ASSERT_TRUE(addresses[0] == 0x1000);
+		ASSERT_TRUE(addresses[1] == 0x2000);
+		ASSERT_TRUE(addresses[2] == 0x3000);
+	}
+
+	TEST(copy)
+	{
+		BreakpointTable a;
+
+		a[0x1000] = 1;
+
+		BreakpointTable b(a);
+
+		b[0x2000] = 2;
+		ASSERT_TRUE(b.contains(0x1000));
+		ASSERT_TRUE(b.contains(0x2000));
+		ASSERT_TRUE(!a.contains(0x2000));
+	}
+}
@@ -66,4 +66,40 @@ TESTSUITE(utils)
 		// Filename with slash
 		ASSERT_TRUE(dir_concat(singleDoubleSlashes, "/hej") == "/kalle/hej");
 	}
+
+	TEST(mapFile)
+	{
+		std::string filename = fmt("/tmp/kcov-map-file-%d", getpid());
+		std::string contents(5000, 'a');
+		size_t sz;
+
+		contents[4999] = 'b';
+		xwrite_file(contents.c_str(), contents.size(), "%s", filename.c_str());
+
+		char *p = (char *)map_file(&sz, "%s", filename.c_str());
+		ASSERT_TRUE(p);
+		ASSERT_TRUE(sz == contents.size());
+		ASSERT_TRUE(std::string(p, sz) == contents);
+
+		// Private mapping, the file is unchanged
+		p[0] = 'c';
+		unmap_file(p, sz);
+
+		p = (char *)read_file(&sz, "%s", filename.c_str());
+		ASSERT_TRUE(p);
+		ASSERT_TRUE(sz == contents.size());
+		ASSERT_TRUE(std::string(p) == contents);
+		free(p);
+
+		// Empty files are read instead of mapped
+		xwrite_file("", 0, "%s", filename.c_str());
+		p = (char *)map_file(&sz, "%s", filename.c_str());
+		ASSERT_TRUE(p);
+		ASSERT_TRUE(sz == 0);
+		unmap_file(p, sz);
+
+		unlink(filename.c_str());
+
+		ASSERT_TRUE(map_file(&sz, "%s", filename.c_str()) == NULL);
+	}
 }
@@ -0,0 +1,83 @@
+#include <breakpoint-table.hh>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <unordered_map>
+#include <vector>
+
+using namespace kcov;
+
+// Rough allocation size of an unordered_map: one node per entry plus the bucket array
+template<typename T>
+static size_t unorderedMapMemoryUsage(const T &map)
+{
+	return map.size() * (sizeof(void *) + sizeof(typename T::value_type) + sizeof(size_t))
+			+ map.bucket_count() * sizeof(void *);
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned long n = 10000000;
+
+	if (argc >= 2)
+		n = strtoul(argv[1], NULL, 0);
+
+	// Breakpoint-like addresses: increasing, a few bytes apart
+	std::vector<unsigned long> addresses(n);
+	unsigned long addr = 0x400000;
+
+	srand(1);
+	for (unsigned long i = 0; i < n; i++)
+	{
+		addr += 1 + rand() % 8;
+		addresses[i] = addr;
+	}
+
+	// ... and looked up in the order they are hit
+	std::vector<unsigned long> lookups(addresses);
+
+	for (unsigned long i = n - 1; i > 0; i--)
+		std::swap(lookups[i], lookups[rand() % (i + 1)]);
+
+	double start, built;
+	unsigned long found = 0;
+
+	std::unordered_map<unsigned long, unsigned long> map;
+
+	start = now();
+	for (unsigned long i = 0; i < n; i++)
+		map[addresses[i]] = i;
+	built = now();
+	for (unsigned long i = 0; i < n; i++)
+		found += map.find(lookups[i]) != map.end();
+	printf("unordered_map:    build %6.3f s, lookup %6.1f ns, %6.1f MiB\n",
+			built - start, (now() - built) * 1000000000.0 / n,
+			unorderedMapMemoryUsage(map) / (1024.0 * 1024.0));
+	map.clear();
+
+	BreakpointTable table;
+
+	start = now();
+	table.reserve(n);
+	for (unsigned long i = 0; i < n; i++)
+		table[addresses[i]] = i;
+	built = now();
+	for (unsigned long i = 0; i < n; i++)
+		found += table.contains(lookups[i]);
+	printf("BreakpointTable:  build %6.3f s, lookup %6.1f ns, %6.1f MiB\n",
+			built - start, (now() - built) * 1000000000.0 / n,
+			table.memoryUsage() / (1024.0 * 1024.0));
+
+	return found == n * 2 ? 0 : 1;
+}
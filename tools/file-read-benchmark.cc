@@ -0,0 +1,117 @@
+#include <utils.hh>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Compares the ways of getting at the binaries kcov reads at startup: the
+ * ELF images and separate debug files, which are hashed for the debug link
+ * CRC and then parsed in place.
+ */
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// read_file() before it used the file size, growing the buffer 1 KiB at a time
+static void *readChunked(size_t *out_size, const char *path)
+{
+	const size_t chunk = 1024;
+	uint8_t *data = NULL;
+	size_t pos = 0;
+	int fd = open(path, O_RDONLY);
+	ssize_t n;
+
+	if (fd < 0)
+		return NULL;
+
+	do
+	{
+		data = (uint8_t *)xrealloc(data, pos + chunk);
+		memset(data + pos, 0, chunk);
+
+		n = read(fd, data + pos, chunk);
+		if (n < 0)
+		{
+			close(fd);
+			free(data);
+
+			return NULL;
+		}
+
+		pos += n;
+	} while (n != 0);
+	close(fd);
+
+	*out_size = pos;
+
+	return data;
+}
+
+int main(int argc, const char *argv[])
+{
+	std::vector<std::string> files;
+	unsigned int rounds = 10;
+	uint32_t hash = 0;
+
+	for (int i = 1; i < argc; i++)
+		files.push_back(argv[i]);
+	if (files.empty())
+		files.push_back("/proc/self/exe");
+
+	double chunked = 0, read = 0, mapped = 0;
+	size_t total = 0;
+
+	for (unsigned int round = 0; round < rounds; round++)
+	{
+		for (std::vector<std::string>::const_iterator it = files.begin(); it != files.end(); ++it)
+		{
+			double start;
+			size_t sz;
+			void *p;
+
+			start = now();
+			p = readChunked(&sz, it->c_str());
+			if (!p)
+			{
+				fprintf(stderr, "Can't read %s\n", it->c_str());
+				return 1;
+			}
+			hash += hash_block(p, sz);
+			free(p);
+			chunked += now() - start;
+			total += sz;
+
+			start = now();
+			p = read_file(&sz, "%s", it->c_str());
+			hash += hash_block(p, sz);
+			free(p);
+			read += now() - start;
+
+			start = now();
+			p = map_file(&sz, "%s", it->c_str());
+			hash += hash_block(p, sz);
+			unmap_file(p, sz);
+			mapped += now() - start;
+		}
+	}
+
+	printf("%zu files, %.1f MiB, %u rounds (hash %08x)\n", files.size(),
+			total / (1024.0 * 1024.0 * rounds), rounds, hash);
+	printf("read 1 KiB chunks: %7.3f s\n", chunked);
+	printf("read_file():       %7.3f s\n", read);
+	printf("map_file():        %7.3f s\n", mapped);
+
+	return 0;
+}
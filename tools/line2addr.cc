@@ -1,50 +1,443 @@
 #include <configuration.hh>
+#include <elf.hh>
 #include <file-parser.hh>
 #include <utils.hh>
 
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
 using namespace kcov;
 
 const char *kcov_version = "";
 
-class Listener : public IFileParser::ILineListener
+/*
+ * (file, line) <-> address index of a binary
+ *
+ * Built once from the parser, or read from an index file saved next to the
+ * binary, so that a stream of queries doesn't parse the binary again.
+ */
+class Index : public IFileParser::ILineListener, public IFileParser::IFunctionListener
 {
 public:
-	Listener(IFileParser &parser, const std::string &filePattern, int lineNr) :
-		m_filePattern(filePattern),
-		m_lineNr(lineNr)
+	// One line, sorted by file, line and address
+	struct Line
+	{
+		uint32_t m_file;
+		uint32_t m_lineNr;
+		uint64_t m_addr;
+
+		bool operator<(const Line &other) const
+		{
+			if (m_file != other.m_file)
+				return m_file < other.m_file;
+			if (m_lineNr != other.m_lineNr)
+				return m_lineNr < other.m_lineNr;
+
+			return m_addr < other.m_addr;
+		}
+	};
+
+	// A function with contiguous code, [m_start, m_end)
+	struct Function
+	{
+		uint64_t m_start;
+		uint64_t m_end;
+
+		bool operator<(const Function &other) const
+		{
+			return m_start < other.m_start;
+		}
+	};
+
+	typedef std::vector<Line> LineList_t;
+	typedef std::vector<Function> FunctionList_t;
+	typedef std::vector<std::string> FileList_t;
+
+	Index()
 	{
-		parser.registerLineListener(*this);
 	}
 
-	virtual ~Listener()
+	virtual ~Index()
 	{
 	}
 
-	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	bool build(const std::string &binary)
 	{
-		if (file.find(m_filePattern) != std::string::npos) {
-			if (m_lineNr < 0 || lineNr == (unsigned int)m_lineNr)
-				report(addr);
+		IFileParser *parser = IParserManager::getInstance().matchParser(binary);
+		if (!parser) {
+			fprintf(stderr, "Can't match parser for %s\n", binary.c_str());
+			return false;
+		}
+
+		parser->registerLineListener(*this);
+		parser->registerFunctionListener(*this);
+		parser->addFile(binary);
+		if (!parser->parse())
+			return false;
+
+		// Number the files in sorted order, which sorts the lines by filename
+		std::vector<uint32_t> order(m_files.size());
+		FileList_t files;
+
+		for (FileIdMap_t::const_iterator it = m_fileIds.begin(); it != m_fileIds.end(); ++it) {
+			order[it->second] = files.size();
+			files.push_back(it->first);
 		}
+		for (LineList_t::iterator it = m_lines.begin(); it != m_lines.end(); ++it)
+			it->m_file = order[it->m_file];
+
+		m_files = files;
+		m_fileIds.clear();
+		finish();
+
+		return true;
+	}
+
+	bool load(const std::string &path, const std::string &binary)
+	{
+		size_t size;
+		uint8_t *data = (uint8_t *)map_file(&size, "%s", path.c_str());
+
+		if (!data)
+			return false;
+
+		const IndexHeader *hdr = (const IndexHeader *)data;
+		bool out = size >= sizeof(IndexHeader) &&
+				hdr->m_magic == INDEX_MAGIC && hdr->m_version == INDEX_VERSION &&
+				hdr->size() == size && hdr->matches(binary);
+
+		if (out) {
+			const Line *lines = (const Line *)(hdr + 1);
+			const Function *functions = (const Function *)(lines + hdr->m_nLines);
+			const char *names = (const char *)(functions + hdr->m_nFunctions);
+
+			out = hdr->m_namesSize == 0 || names[hdr->m_namesSize - 1] == '\0';
+			if (out) {
+				m_lines.assign(lines, lines + hdr->m_nLines);
+				m_functions.assign(functions, functions + hdr->m_nFunctions);
+				m_files.clear();
+				for (const char *cur = names; cur < names + hdr->m_namesSize; cur += strlen(cur) + 1)
+					m_files.push_back(cur);
+
+				for (LineList_t::const_iterator it = m_lines.begin(); out && it != m_lines.end(); ++it)
+					out = it->m_file < m_files.size();
+			}
+		}
+		unmap_file(data, size);
+
+		if (out)
+			finish();
+		else {
+			m_lines.clear();
+			m_functions.clear();
+		}
+
+		return out;
+	}
+
+	bool save(const std::string &path, const std::string &binary) const
+	{
+		IndexHeader hdr;
+		std::string names;
+
+		for (FileList_t::const_iterator it = m_files.begin(); it != m_files.end(); ++it)
+			names.append(it->c_str(), it->size() + 1);
+
+		if (!hdr.setup(binary))
+			return false;
+		hdr.m_nLines = m_lines.size();
+		hdr.m_nFunctions = m_functions.size();
+		hdr.m_namesSize = names.size();
+
+		uint8_t *data = (uint8_t *)xmalloc(hdr.size());
+		uint8_t *p = data;
+
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+		if (!m_lines.empty())
+			memcpy(p, m_lines.data(), m_lines.size() * sizeof(Line));
+		p += m_lines.size() * sizeof(Line);
+		if (!m_functions.empty())
+			memcpy(p, m_functions.data(), m_functions.size() * sizeof(Function));
+		p += m_functions.size() * sizeof(Function);
+		memcpy(p, names.c_str(), names.size());
+
+		std::string tmp = fmt("%s.%d", path.c_str(), getpid());
+		bool out = write_file(data, hdr.size(), "%s", tmp.c_str()) == 0 && rename(tmp.c_str(), path.c_str()) == 0;
+
+		if (!out)
+			unlink(tmp.c_str());
+		free(data);
+
+		return out;
+	}
+
+	// The addresses of the lines in files matching @a filePattern, all lines if lineNr < 0
+	std::vector<uint64_t> lookupLine(const std::string &filePattern, int lineNr) const
+	{
+		std::vector<uint64_t> out;
+
+		for (uint32_t file = 0; file < m_files.size(); file++) {
+			if (m_files[file].find(filePattern) == std::string::npos)
+				continue;
+
+			Line first = {file, lineNr < 0 ? 0 : (uint32_t)lineNr, 0};
+			Line last = {lineNr < 0 ? file + 1 : file, lineNr < 0 ? 0 : (uint32_t)lineNr + 1, 0};
+
+			LineList_t::const_iterator it = std::lower_bound(m_lines.begin(), m_lines.end(), first);
+			LineList_t::const_iterator end = std::lower_bound(it, m_lines.end(), last);
+			for (; it != end; ++it)
+				out.push_back(it->m_addr);
+		}
+
+		return out;
+	}
+
+	/*
+	 * The line at or last before @a addr, NULL if there is none. The address
+	 * has to be in the function of that line, or, for lines outside of the
+	 * known functions, before the next line. Addresses in the PLT, past the
+	 * code or in other binaries therefore have no line.
+	 */
+	const Line *lookupAddress(uint64_t addr) const
+	{
+		AddressList_t::const_iterator it = std::upper_bound(m_byAddress.begin(), m_byAddress.end(), addr,
+				AddressCompare(m_lines));
+
+		if (it == m_byAddress.begin())
+			return NULL;
+
+		bool last = it == m_byAddress.end();
+
+		// The first of the lines at that address
+		--it;
+		it = std::lower_bound(m_byAddress.begin(), it, m_lines[*it].m_addr, AddressCompare(m_lines));
+
+		const Function *function = lookupFunction(m_lines[*it].m_addr);
+
+		if (function ? addr >= function->m_end : last)
+			return NULL;
+
+		return &m_lines[*it];
+	}
+
+	const std::string &getFile(const Line &line) const
+	{
+		return m_files[line.m_file];
+	}
+
+	// From IFileParser::ILineListener
+	void onLine(const std::string &file, unsigned int lineNr, uint64_t addr)
+	{
+		std::pair<FileIdMap_t::iterator, bool> res = m_fileIds.insert(FileIdMap_t::value_type(file, m_files.size()));
+
+		if (res.second)
+			m_files.push_back(file);
+
+		Line line = {res.first->second, lineNr, addr};
+		m_lines.push_back(line);
+	}
+
+	// From IFileParser::IFunctionListener
+	void onFunction(uint64_t start, uint64_t end)
+	{
+		Function function = {start, end};
+
+		m_functions.push_back(function);
 	}
 
 private:
-	void report(unsigned long addr)
+	enum
+	{
+		INDEX_MAGIC = 0x6c326169, // "l2ai"
+		INDEX_VERSION = 2,
+	};
+
+	// The header is followed by the lines, the functions and the NUL-terminated filenames
+	struct IndexHeader
+	{
+		uint32_t m_magic;
+		uint32_t m_version;
+		uint64_t m_binarySize;
+		uint64_t m_binaryTimestamp;
+		char m_buildId[128]; // Hex, NUL-terminated, empty if there is none
+		uint64_t m_nLines;
+		uint64_t m_nFunctions;
+		uint64_t m_namesSize;
+
+		bool setup(const std::string &binary)
+		{
+			struct stat st;
+
+			if (stat(binary.c_str(), &st) < 0)
+				return false;
+
+			memset(this, 0, sizeof(*this));
+			m_magic = INDEX_MAGIC;
+			m_version = INDEX_VERSION;
+			m_binarySize = st.st_size;
+			m_binaryTimestamp = get_file_timestamp(binary);
+
+			IElf *elf = IElf::create(binary);
+
+			if (elf) {
+				strncpy(m_buildId, elf->getBuildId().c_str(), sizeof(m_buildId) - 1);
+				delete elf;
+			}
+
+			return true;
+		}
+
+		/*
+		 * A rebuilt binary invalidates the index. The timestamp only has a
+		 * resolution of a second, so the build-id is compared as well.
+		 */
+		bool matches(const std::string &binary) const
+		{
+			IndexHeader cur;
+
+			return cur.setup(binary) && cur.m_binarySize == m_binarySize &&
+					cur.m_binaryTimestamp == m_binaryTimestamp &&
+					memcmp(cur.m_buildId, m_buildId, sizeof(m_buildId)) == 0;
+		}
+
+		size_t size() const
+		{
+			return sizeof(IndexHeader) + m_nLines * sizeof(Line) + m_nFunctions * sizeof(Function) + m_namesSize;
+		}
+	};
+
+	typedef std::map<std::string, uint32_t> FileIdMap_t;
+	typedef std::vector<uint32_t> AddressList_t;
+
+	class AddressCompare
+	{
+	public:
+		AddressCompare(const LineList_t &lines) :
+			m_lines(lines)
+		{
+		}
+
+		bool operator()(uint64_t addr, uint32_t idx) const
+		{
+			return addr < m_lines[idx].m_addr;
+		}
+
+		bool operator()(uint32_t idx, uint64_t addr) const
+		{
+			return m_lines[idx].m_addr < addr;
+		}
+
+		bool operator()(uint32_t a, uint32_t b) const
+		{
+			return m_lines[a].m_addr < m_lines[b].m_addr;
+		}
+
+	private:
+		const LineList_t &m_lines;
+	};
+
+	// The function @a addr is in, NULL if none
+	const Function *lookupFunction(uint64_t addr) const
 	{
-		printf("0x%lx\n", addr);
+		Function key = {addr, addr};
+		FunctionList_t::const_iterator it = std::upper_bound(m_functions.begin(), m_functions.end(), key);
+
+		if (it == m_functions.begin() || addr >= (--it)->m_end)
+			return NULL;
+
+		return &*it;
+	}
+
+	void finish()
+	{
+		std::sort(m_lines.begin(), m_lines.end());
+		std::sort(m_functions.begin(), m_functions.end());
+
+		// Stable, so that the lowest line of an address comes first
+		m_byAddress.resize(m_lines.size());
+		for (uint32_t i = 0; i < m_lines.size(); i++)
+			m_byAddress[i] = i;
+		std::stable_sort(m_byAddress.begin(), m_byAddress.end(), AddressCompare(m_lines));
 	}
 
-	const std::string m_filePattern;
-	int m_lineNr;
+	LineList_t m_lines;
+	FunctionList_t m_functions;
+	FileList_t m_files;
+	FileIdMap_t m_fileIds;
+	AddressList_t m_byAddress;
 };
 
+// "file-pattern[:line-nr]" prints the addresses, "0xaddr" prints file:line
+static void query(const Index &index, const std::string &q)
+{
+	if (q.empty()) {
+		printf("\n");
+		return;
+	}
+
+	if (q.size() > 2 && q[0] == '0' && (q[1] == 'x' || q[1] == 'X') && string_is_integer(q, 16)) {
+		const Index::Line *line = index.lookupAddress(string_to_integer(q, 16));
+
+		if (line)
+			printf("%s:%u\n", index.getFile(*line).c_str(), line->m_lineNr);
+		else
+			printf("??:0\n");
+		return;
+	}
+
+	std::string filePattern = q;
+	int lineNr = -1;
+	size_t colon = q.rfind(':');
+
+	if (colon != std::string::npos && string_is_integer(q.substr(colon + 1), 10)) {
+		filePattern = q.substr(0, colon);
+		lineNr = string_to_integer(q.substr(colon + 1), 10);
+	}
+
+	std::vector<uint64_t> addrs = index.lookupLine(filePattern, lineNr);
+	std::string out;
+
+	for (std::vector<uint64_t>::const_iterator it = addrs.begin(); it != addrs.end(); ++it)
+		out += fmt("%s0x%llx", out.empty() ? "" : " ", (unsigned long long)*it);
+	printf("%s\n", out.c_str());
+}
+
+static int usage()
+{
+	fprintf(stderr,
+			"Usage: line2addr [-i] in-file file-pattern [line-nr]\n"
+			"       line2addr [-i] in-file -\n"
+			"\n"
+			"With -, queries are read from stdin, one per line, and answered with one line each:\n"
+			"  file-pattern[:line-nr]  the addresses of the line, space separated\n"
+			"  0xaddress               the file:line of the address\n"
+			"\n"
+			"-i reads the index from, or saves it to, in-file.line2addr\n");
+
+	return 1;
+}
+
 int main(int argc, const char *argv[])
 {
-	if (argc < 3) {
-		fprintf(stderr, "Usage: line2addr in-file file-pattern [line-nr]\n");
-		return 1;
+	bool useIndexFile = false;
+
+	if (argc >= 2 && std::string(argv[1]) == "-i") {
+		useIndexFile = true;
+		argc--;
+		argv++;
 	}
 
+	if (argc < 3)
+		return usage();
+
 	std::string file(argv[1]);
 	std::string fileName(argv[2]);
 	int lineNr = -1;
@@ -58,16 +451,36 @@ int main(int argc, const char *argv[])
 		lineNr = string_to_integer(argv[3]);
 	}
 
+	std::string indexFile = file + ".line2addr";
+	Index index;
+
+	if (!useIndexFile || !index.load(indexFile, file)) {
+		if (!index.build(file))
+			return 1;
+
+		if (useIndexFile && !index.save(indexFile, file))
+			fprintf(stderr, "Can't write index %s\n", indexFile.c_str());
+	}
+
+	if (fileName != "-") {
+		std::vector<uint64_t> addrs = index.lookupLine(fileName, lineNr);
+
+		for (std::vector<uint64_t>::const_iterator it = addrs.begin(); it != addrs.end(); ++it)
+			printf("0x%llx\n", (unsigned long long)*it);
 
-	IFileParser *parser = IParserManager::getInstance().matchParser(file);
-	if (!parser) {
-		fprintf(stderr, "Can't match parser for %s\n", file.c_str());
-		return 1;
+		return 0;
 	}
 
-	Listener listener(*parser, fileName, lineNr);
+	// Flush each answer, the other end waits for it before the next query
+	setvbuf(stdout, NULL, _IOLBF, 0);
 
-	parser->addFile(file);
+	std::string line;
+	while (std::getline(std::cin, line)) {
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+
+		query(index, line);
+	}
 
-	return parser->parse() ? 0 : 1;
+	return 0;
 }
@@ -0,0 +1,87 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/engines/ptrace_sys.hh"
+
+/*
+ * Traces a child which stops itself a number of times, and handles each stop
+ * like kcov handles a breakpoint: the PC is looked up when the event is
+ * received and again when the hit is reported. With the register cache, each
+ * stop should cost a single register read (PEEKUSER on x86).
+ */
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int n = 100000;
+	unsigned long pcs = 0;
+	unsigned int stops = 0;
+	int status;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 0);
+
+	pid_t child = fork();
+	if (child < 0)
+	{
+		perror("fork");
+		return 1;
+	}
+	if (child == 0)
+	{
+		ptrace_sys::trace_me();
+		raise(SIGSTOP);
+		for (unsigned int i = 0; i < n; i++)
+			raise(SIGTRAP);
+		_exit(0);
+	}
+
+	if (ptrace_sys::wait_pid(child, &status) < 0 || !WIFSTOPPED(status))
+	{
+		fprintf(stderr, "Child hasn't stopped: %x\n", status);
+		return 1;
+	}
+
+	unsigned long accesses = ptrace_sys::getRegisterAccesses();
+	double start = now();
+
+	ptrace_sys::cont(child, 0);
+	while (ptrace_sys::wait_pid(child, &status) == child && WIFSTOPPED(status))
+	{
+		// Once for the event, once for the hit
+		pcs += ptrace_sys::getPc(child);
+		pcs += ptrace_sys::getPc(child);
+
+		stops++;
+		ptrace_sys::cont(child, 0);
+	}
+
+	double elapsed = now() - start;
+
+	accesses = ptrace_sys::getRegisterAccesses() - accesses;
+	if (stops == 0)
+	{
+		fprintf(stderr, "No stops seen\n");
+		return 1;
+	}
+
+	printf("%u stops in %.3f s (%.2f us/stop, pc sum %lx)\n", stops, elapsed,
+			elapsed * 1000000 / stops, pcs);
+	printf("register accesses: %lu (%.2f per stop)\n", accesses, (double)accesses / stops);
+
+	return 0;
+}